@@ -0,0 +1,198 @@
+// Compression ratio vs CPU cost of the libmqttlink payload codecs on JSON telemetry.
+// Mirrors the library's codec settings: 7 byte header, one-shot compression, optional dictionary.
+#include <lz4.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zdict.h>
+#include <zstd.h>
+
+#define CODEC_HEADER_SIZE 7
+#define DICTIONARY_SIZE (16 * 1024)
+
+struct struct_payload
+{
+    char *data;
+    size_t len;
+};
+
+static double get_monotonic_time(void);
+static size_t generate_payload(char *buf, size_t cap, int device, int seq);
+static void run_case(const char *name, int codec, int level, const void *dict, size_t dict_size, struct struct_payload *payloads, int count, int iterations);
+
+enum
+{
+    codec_lz4,
+    codec_zstd
+};
+
+int main(int argc, char *argv[])
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 2000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 20;
+    if (count < 10 || iterations < 1)
+    {
+        fprintf(stderr, "Usage: %s [payload_count >= 10] [iterations >= 1]\n", argv[0]);
+        return 1;
+    }
+
+    // first half trains the dictionary, second half is measured
+    int total = count * 2;
+    struct struct_payload *payloads = calloc(total, sizeof(*payloads));
+    size_t *sizes = calloc(count, sizeof(*sizes));
+    char *samples = malloc((size_t)count * 4096);
+    if (!payloads || !sizes || !samples)
+        return 1;
+
+    size_t sample_bytes = 0;
+    for (int i = 0; i < total; i++)
+    {
+        payloads[i].data = malloc(4096);
+        payloads[i].len = generate_payload(payloads[i].data, 4096, i % 64, i);
+        if (i < count)
+        {
+            memcpy(samples + sample_bytes, payloads[i].data, payloads[i].len);
+            sizes[i] = payloads[i].len;
+            sample_bytes += payloads[i].len;
+        }
+    }
+
+    char *dict = malloc(DICTIONARY_SIZE);
+    size_t dict_size = ZDICT_trainFromBuffer(dict, DICTIONARY_SIZE, samples, sizes, count);
+    if (ZDICT_isError(dict_size))
+    {
+        fprintf(stderr, "Dictionary training failed: %s\n", ZDICT_getErrorName(dict_size));
+        return 1;
+    }
+
+    size_t raw = 0;
+    for (int i = count; i < total; i++)
+        raw += payloads[i].len;
+    printf("%d payloads, average %zu bytes, dictionary %zu bytes, %d iterations\n\n", count, raw / count, dict_size, iterations);
+    printf("%-18s %8s %12s %12s %10s %10s\n", "codec", "ratio", "comp MB/s", "decomp MB/s", "comp us", "decomp us");
+
+    run_case("lz4", codec_lz4, 1, NULL, 0, payloads + count, count, iterations);
+    run_case("lz4+dict", codec_lz4, 1, dict, dict_size, payloads + count, count, iterations);
+    run_case("zstd-1", codec_zstd, 1, NULL, 0, payloads + count, count, iterations);
+    run_case("zstd-3", codec_zstd, 3, NULL, 0, payloads + count, count, iterations);
+    run_case("zstd-1+dict", codec_zstd, 1, dict, dict_size, payloads + count, count, iterations);
+    run_case("zstd-3+dict", codec_zstd, 3, dict, dict_size, payloads + count, count, iterations);
+    run_case("zstd-9+dict", codec_zstd, 9, dict, dict_size, payloads + count, count, iterations);
+
+    for (int i = 0; i < total; i++)
+        free(payloads[i].data);
+    free(payloads);
+    free(sizes);
+    free(samples);
+    free(dict);
+    return 0;
+}
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Repetitive fleet telemetry: fixed keys, a few varying readings, 1-4 KB.
+static size_t generate_payload(char *buf, size_t cap, int device, int seq)
+{
+    size_t n = (size_t)snprintf(buf, cap, "{\"device_id\":\"edge-gw-%04d\",\"firmware\":\"2.%d.7\",\"timestamp\":%d,\"site\":\"plant-%d\",\"sensors\":[", device, device % 4, 1700000000 + seq, device % 8);
+    int sensors = 8 + (seq * 7 + device) % 32;
+    for (int s = 0; s < sensors && n < cap - 160; s++)
+    {
+        n += (size_t)snprintf(buf + n, cap - n, "%s{\"id\":\"s%02d\",\"type\":\"%s\",\"value\":%d.%02d,\"unit\":\"%s\",\"status\":\"ok\"}", s ? "," : "", s,
+                              (s & 1) ? "temperature" : "humidity", 20 + (seq + s) % 15, (seq * 31 + s * 17) % 100, (s & 1) ? "celsius" : "percent");
+    }
+    n += (size_t)snprintf(buf + n, cap - n, "],\"rssi\":-%d,\"uptime\":%d}", 40 + seq % 50, seq * 10);
+    return n < cap ? n : cap - 1;
+}
+
+static void run_case(const char *name, int codec, int level, const void *dict, size_t dict_size, struct struct_payload *payloads, int count, int iterations)
+{
+    size_t cap = ZSTD_compressBound(4096) + CODEC_HEADER_SIZE;
+    char *compressed = malloc((size_t)count * cap);
+    size_t *compressed_len = calloc(count, sizeof(*compressed_len));
+    char out[4096];
+
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_CDict *cdict = (codec == codec_zstd && dict) ? ZSTD_createCDict(dict, dict_size, level) : NULL;
+    ZSTD_DDict *ddict = (codec == codec_zstd && dict) ? ZSTD_createDDict(dict, dict_size) : NULL;
+    LZ4_stream_t *lz4_dict_stream = NULL;
+    LZ4_stream_t *lz4_stream = LZ4_createStream();
+    if (codec == codec_lz4 && dict)
+    {
+        lz4_dict_stream = LZ4_createStream();
+        LZ4_loadDict(lz4_dict_stream, dict, (int)dict_size);
+    }
+
+    size_t raw = 0, packed = 0;
+    double start = get_monotonic_time();
+    for (int it = 0; it < iterations; it++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            char *dst = compressed + (size_t)i * cap + CODEC_HEADER_SIZE;
+            size_t len = 0;
+            if (codec == codec_zstd)
+                len = cdict ? ZSTD_compress_usingCDict(cctx, dst, cap, payloads[i].data, payloads[i].len, cdict)
+                            : ZSTD_compressCCtx(cctx, dst, cap, payloads[i].data, payloads[i].len, level);
+            else if (lz4_dict_stream)
+            {
+                memcpy(lz4_stream, lz4_dict_stream, sizeof(LZ4_stream_t)); // same as the library
+                len = (size_t)LZ4_compress_fast_continue(lz4_stream, payloads[i].data, dst, (int)payloads[i].len, (int)cap, level);
+            }
+            else
+                len = (size_t)LZ4_compress_fast(payloads[i].data, dst, (int)payloads[i].len, (int)cap, level);
+            compressed_len[i] = len;
+        }
+    }
+    double compress_time = get_monotonic_time() - start;
+
+    for (int i = 0; i < count; i++)
+    {
+        raw += payloads[i].len;
+        packed += CODEC_HEADER_SIZE + compressed_len[i];
+    }
+
+    start = get_monotonic_time();
+    for (int it = 0; it < iterations; it++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            const char *src = compressed + (size_t)i * cap + CODEC_HEADER_SIZE;
+            size_t len = 0;
+            if (codec == codec_zstd)
+                len = ddict ? ZSTD_decompress_usingDDict(dctx, out, sizeof(out), src, compressed_len[i], ddict)
+                            : ZSTD_decompressDCtx(dctx, out, sizeof(out), src, compressed_len[i]);
+            else if (dict)
+                len = (size_t)LZ4_decompress_safe_usingDict(src, out, (int)compressed_len[i], sizeof(out), dict, (int)dict_size);
+            else
+                len = (size_t)LZ4_decompress_safe(src, out, (int)compressed_len[i], sizeof(out));
+            if (len != payloads[i].len || memcmp(out, payloads[i].data, len))
+            {
+                fprintf(stderr, "%s: round trip mismatch on payload %d\n", name, i);
+                exit(1);
+            }
+        }
+    }
+    double decompress_time = get_monotonic_time() - start;
+
+    double total_mb = (double)raw * iterations / 1e6;
+    double messages = (double)count * iterations;
+    printf("%-18s %8.2f %12.1f %12.1f %10.2f %10.2f\n", name, (double)raw / packed, total_mb / compress_time, total_mb / decompress_time,
+           compress_time * 1e6 / messages, decompress_time * 1e6 / messages);
+
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeDDict(ddict);
+    LZ4_freeStream(lz4_stream);
+    if (lz4_dict_stream)
+        LZ4_freeStream(lz4_dict_stream);
+    free(compressed);
+    free(compressed_len);
+}
@@ -0,0 +1,122 @@
+// Publish -> broker -> subscribe round trip latency and jitter through libmqttlink.
+// Run once with default placement and once with the network thread pinned to an isolated core
+// (e.g. booted with isolcpus=3) to compare the tail latency.
+#include <libmqttlink/libmqttlink.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double get_monotonic_time(void);
+static void sleep_microsec(unsigned int microsec);
+static int compare_double(const void *a, const void *b);
+static void on_message_received(const char *message, const char *topic);
+
+static double *g_latencies = NULL;
+static volatile int g_received = 0;
+static int g_count = 0;
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5)
+    {
+        fprintf(stderr, "Usage: %s <server_ip> <port> <username> <password> [count] [interval_us] [cpu] [fifo_priority]\n", argv[0]);
+        return 1;
+    }
+
+    g_count = (argc > 5) ? atoi(argv[5]) : 10000;
+    unsigned int interval_us = (argc > 6) ? (unsigned int)atoi(argv[6]) : 1000;
+    int cpu = (argc > 7) ? atoi(argv[7]) : -1;
+    int priority = (argc > 8) ? atoi(argv[8]) : 0;
+    g_latencies = calloc(g_count, sizeof(double));
+    if (g_count <= 0 || !g_latencies)
+        return 1;
+
+    struct _struct_libmqttlink_thread_config config = {0};
+    config.name = "mqttlink-bench";
+    if (cpu >= 0)
+    {
+        config.cpus = &cpu;
+        config.number_of_cpus = 1;
+    }
+    config.sched_fifo_priority = priority;
+    if (libmqttlink_set_thread_config(e_libmqttlink_thread_role_network, &config) != 0)
+        return 1;
+
+    char topic[128];
+    snprintf(topic, sizeof(topic), "libmqttlink/bench/latency/%d", (int)getpid());
+
+    libmqttlink_connect_and_monitor(argv[1], atoi(argv[2]), argv[3], argv[4]);
+    while (libmqttlink_get_connection_state() != e_libmqttlink_connection_state_connection_true)
+        sleep_microsec(10000);
+    libmqttlink_subscribe_topic(topic, 0, on_message_received);
+    sleep_microsec(3000000); // let the subscription settle
+
+    for (int i = 0; i < g_count; i++)
+    {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%d %.9f", i, get_monotonic_time());
+        libmqttlink_publish_message(topic, msg, 0);
+        sleep_microsec(interval_us);
+    }
+    double deadline = get_monotonic_time() + 5;
+    while (g_received < g_count && get_monotonic_time() < deadline)
+        sleep_microsec(10000);
+
+    int n = g_received;
+    libmqttlink_shutdown();
+    if (n == 0)
+    {
+        fprintf(stderr, "No messages received.\n");
+        return 1;
+    }
+
+    double sum = 0, sum_sq = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += g_latencies[i];
+        sum_sq += g_latencies[i] * g_latencies[i];
+    }
+    double mean = sum / n;
+    qsort(g_latencies, n, sizeof(double), compare_double);
+    printf("placement: cpu=%d fifo_priority=%d\n", cpu, priority);
+    printf("received %d/%d\n", n, g_count);
+    printf("latency us: mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n", mean, g_latencies[n / 2], g_latencies[n * 9 / 10],
+           g_latencies[n * 99 / 100], g_latencies[n * 999 / 1000], g_latencies[n - 1]);
+    printf("jitter us: stddev %.1f p99-p50 %.1f\n", sqrt(sum_sq / n - mean * mean), g_latencies[n * 99 / 100] - g_latencies[n / 2]);
+    if (n < g_count || g_latencies[n / 2] > interval_us)
+        printf("warning: the receiver fell behind the publish rate, the numbers include queueing. Increase interval_us.\n");
+    free(g_latencies);
+    return 0;
+}
+
+static void on_message_received(const char *message, const char *topic)
+{
+    (void)topic;
+    double now = get_monotonic_time();
+    int seq = 0;
+    double sent = 0;
+    if (sscanf(message, "%d %lf", &seq, &sent) != 2 || g_received >= g_count)
+        return;
+    g_latencies[g_received++] = (now - sent) * 1e6;
+}
+
+static double get_monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void sleep_microsec(unsigned int microsec)
+{
+    usleep(microsec);
+}
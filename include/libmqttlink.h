@@ -1,6 +1,9 @@
 #ifndef LIBMQTTLINK_H
 #define LIBMQTTLINK_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -16,6 +19,118 @@ enum _enum_libmqttlink_connection_state
     e_libmqttlink_connection_state_connection_true
 };
 
+/**
+ * TLS handshake counters, see libmqttlink_get_tls_stats().
+ */
+struct _struct_libmqttlink_tls_stats
+{
+    unsigned long long handshakes; // completed handshakes
+    unsigned long long resumed;    // handshakes that resumed a cached session
+    double last_handshake_ms;      // duration of the most recent handshake
+    double total_handshake_ms;     // sum of all handshake durations
+};
+
+/**
+ * Trace span kinds.
+ */
+enum _enum_libmqttlink_trace_kind
+{
+    e_libmqttlink_trace_kind_publish, // libmqttlink_publish_message() entry to exit, or a coalesced value sent later
+    e_libmqttlink_trace_kind_receive  // message read from the socket to subscriber callback exit
+};
+
+/**
+ * Sampled timing of one message. Local times are CLOCK_MONOTONIC nanoseconds.
+ */
+struct _struct_libmqttlink_trace_span
+{
+    enum _enum_libmqttlink_trace_kind kind;
+    char topic[64];              // truncated
+    long long start_ns;          // publish call entry (deferred coalesced send start), or message read from the socket
+    long long callback_entry_ns; // subscriber callback entry (receive only, 0 if no callback ran)
+    long long end_ns;            // publish call exit before the 1 ms pacing sleep, or subscriber callback exit
+    long long transit_ns;        // sender stamp to socket read in CLOCK_REALTIME, -1 if the message carried no stamp
+};
+
+#define LIBMQTTLINK_HISTOGRAM_BUCKETS 32
+
+/**
+ * Broker transit latency histogram. Bucket 0 counts samples below 1 us, bucket i counts
+ * samples in [2^(i-1), 2^i) us and the last bucket everything above.
+ */
+struct _struct_libmqttlink_latency_histogram
+{
+    unsigned long long count;
+    unsigned long long buckets[LIBMQTTLINK_HISTOGRAM_BUCKETS];
+    double min_us;
+    double max_us;
+    double sum_us;
+};
+
+/**
+ * Library threads whose placement can be configured.
+ */
+enum _enum_libmqttlink_thread_role
+{
+    e_libmqttlink_thread_role_network, // connection and mosquitto network loop
+    e_libmqttlink_thread_role_count
+};
+
+/**
+ * Placement settings for a library thread.
+ */
+struct _struct_libmqttlink_thread_config
+{
+    const int *cpus;              // CPUs the thread may run on
+    unsigned int number_of_cpus;  // 0 keeps the default affinity
+    int sched_fifo_priority;      // SCHED_FIFO priority, 0 keeps default scheduling
+    size_t stack_size;            // 0 keeps the default stack size
+    const char *name;             // thread name shown in top/ps, truncated to 15 characters, NULL keeps the default
+};
+
+/**
+ * Message delivered to a batch subscription handler. Pointers stay valid until the handler returns.
+ */
+struct _struct_libmqttlink_batch_message
+{
+    const char *topic;
+    const char *payload; // null-terminated
+    unsigned int len;
+    double timestamp; // receive time, seconds since the epoch
+};
+
+/**
+ * Outcome passed to a libmqttlink_request() callback.
+ */
+enum _enum_libmqttlink_request_status
+{
+    e_libmqttlink_request_status_ok,
+    e_libmqttlink_request_status_timeout,
+    e_libmqttlink_request_status_cancelled, // link shut down before a response arrived
+    e_libmqttlink_request_status_error      // response payload could not be decoded
+};
+
+/**
+ * Payload compression codecs.
+ */
+enum _enum_libmqttlink_codec
+{
+    e_libmqttlink_codec_none,
+    e_libmqttlink_codec_lz4,
+    e_libmqttlink_codec_zstd
+};
+
+/**
+ * Publish coalescing counters for a topic pattern.
+ */
+struct _struct_libmqttlink_coalescing_stats
+{
+    unsigned long long updates;      // publish calls that matched the pattern
+    unsigned long long published;    // values handed to the broker connection
+    unsigned long long suppressed;   // values replaced by a newer one before being sent
+    unsigned long long rate_limited; // sends deferred because the token bucket was empty
+};
+
 /**
  * Establishes a connection to the MQTT broker and monitors the connection state.
  * @param server_ip_address IP address of the MQTT broker.
@@ -49,6 +164,22 @@ int libmqttlink_publish_message(const char *topic, const char *message_contents,
  */
 int libmqttlink_subscribe_topic(const char *topic, int qos, void (*notification_function_ptr)(const char *message_contents, const char *topic));
 
+/**
+ * Subscribes to a topic filter and delivers matching messages in batches. The handler runs on the
+ * connection thread once max_messages or max_bytes is reached, or linger_ms after the first message
+ * of the batch arrived. Batch memory is reused between deliveries. Messages still queued when
+ * libmqttlink_shutdown() is called are delivered before it returns.
+ * @param topic Topic filter to subscribe to, MQTT wildcards allowed.
+ * @param qos Quality of Service level.
+ * @param max_messages Deliver when this many messages are queued (0 for no limit).
+ * @param max_bytes Deliver when this many bytes are queued (0 for no limit).
+ * @param linger_ms Deliver this long after the first queued message (0 for no limit).
+ * @param batch_function_ptr Callback receiving the messages, their count and the subscribed filter.
+ * @return 0 on success, negative value on error.
+ */
+int libmqttlink_subscribe_topic_batch(const char *topic, int qos, unsigned int max_messages, unsigned int max_bytes, unsigned int linger_ms,
+                                      void (*batch_function_ptr)(const struct _struct_libmqttlink_batch_message *messages, unsigned int count, const char *topic));
+
 /**
  * Unsubscribes from a topic.
  * @param topic Topic to unsubscribe from.
@@ -56,6 +187,39 @@ int libmqttlink_subscribe_topic(const char *topic, int qos, void (*notification_
  */
 int libmqttlink_unsubscribe_topic(const char *topic);
 
+/**
+ * Selects the MQTT protocol version. Version 5 is required for libmqttlink_request() and
+ * libmqttlink_respond(). Must be called before connecting.
+ * @param version 4 for MQTT 3.1.1 (default) or 5 for MQTT 5.
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_set_protocol_version(int version);
+
+/**
+ * Publishes a request with QoS 1 and calls the callback once with the response or on timeout.
+ * Responses arrive on a single response topic shared by all requests and are matched by
+ * MQTT 5 Correlation Data, so thousands of requests can be outstanding at once. The callback
+ * runs on the connection thread. Requires an MQTT 5 connection.
+ * @param topic Topic to publish the request to.
+ * @param payload Request payload.
+ * @param len Payload length in bytes.
+ * @param timeout_ms Time to wait for the response (10 ms resolution).
+ * @param response_function_ptr Callback receiving the status, the null-terminated response payload and its length.
+ * @param user_data Passed to the callback unchanged.
+ * @return 0 on success, -1 on error (the callback is not called).
+ */
+int libmqttlink_request(const char *topic, const char *payload, int len, unsigned int timeout_ms,
+                        void (*response_function_ptr)(enum _enum_libmqttlink_request_status status, const char *payload, int len, void *user_data), void *user_data);
+
+/**
+ * Responds to the request being handled. Only valid inside a libmqttlink_subscribe_topic() callback
+ * for a message carrying an MQTT 5 Response Topic; the Correlation Data is copied to the response.
+ * @param payload Response payload.
+ * @param len Payload length in bytes.
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_respond(const char *payload, int len);
+
 /**
  * Sets the Last Will message.
  * @param topic Topic for the Last Will message.
@@ -78,12 +242,151 @@ int libmqttlink_set_will(const char *topic, const char *payload, int qos, int re
  */
 int libmqttlink_set_tls(const char *cafile, const char *capath, const char *certfile, const char *keyfile, const char *tls_version, int insecure);
 
+/**
+ * Configures TLS session resumption and the offered cipher suites and key exchange groups. The TLS context
+ * is shared across reconnects, so the session ticket from the previous connection is offered on the next
+ * one and a reconnect storm does not become a full handshake storm. Requires the library to be built with
+ * openssl=1 and must be called before connecting, in addition to libmqttlink_set_tls().
+ * @param session_resumption 1 to cache and resume TLS sessions, 0 otherwise.
+ * @param ciphers TLS 1.2 cipher list, e.g. "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-CHACHA20-POLY1305" (NULL for default).
+ * @param ciphersuites TLS 1.3 cipher suites, e.g. "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256" (NULL for default).
+ * @param groups Key exchange groups, e.g. "X25519:P-256" (NULL for default).
+ * @return 0 on success, -1 on error or if OpenSSL support was not built in.
+ */
+int libmqttlink_set_tls_options(int session_resumption, const char *ciphers, const char *ciphersuites, const char *groups);
+
+/**
+ * Returns TLS handshake timing and session resumption counters.
+ * Only handshakes made with libmqttlink_set_tls_options() in effect are counted.
+ * @param stats Output counters.
+ * @return 0 on success, -1 on error or if OpenSSL support was not built in.
+ */
+int libmqttlink_get_tls_stats(struct _struct_libmqttlink_tls_stats *stats);
+
+/**
+ * Enables sampled latency tracing. Every sample_every-th publish and received message is recorded
+ * as a span in a lock-free ring. On MQTT 5 links sampled publishes carry their CLOCK_REALTIME send
+ * time in a user property, and receivers record the broker transit time of stamped messages in
+ * per-topic histograms (meaningful across hosts only with synchronized clocks). Publish calls held back by
+ * coalescing are timed as well; when the connection thread sends the coalesced value later, that send is
+ * sampled and stamped on its own. Must be called before connecting.
+ * @param sample_every Sampling interval, 1 traces every message, 0 disables tracing.
+ * @param ring_size Number of spans kept, rounded up to a power of two (minimum 64).
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_set_tracing(unsigned int sample_every, unsigned int ring_size);
+
+/**
+ * Copies the most recent trace spans out of the ring, oldest first. Does not block writers.
+ * @param spans Output array.
+ * @param max_spans Capacity of the output array.
+ * @return Number of spans copied.
+ */
+int libmqttlink_trace_read(struct _struct_libmqttlink_trace_span *spans, int max_spans);
+
+/**
+ * Writes the spans currently in the ring as CSV. The topic field is quoted (embedded quotes doubled);
+ * transit_us is empty for messages without a send time stamp and negative when the clocks are skewed.
+ * @param stream Output stream.
+ * @return Number of spans written, -1 on error or if tracing is disabled.
+ */
+int libmqttlink_trace_dump(FILE *stream);
+
+/**
+ * Returns the broker transit latency histogram of a topic.
+ * @param topic Topic the messages were received on.
+ * @param histogram Output histogram.
+ * @return 0 on success, -1 if no stamped message was received on the topic.
+ */
+int libmqttlink_get_transit_histogram(const char *topic, struct _struct_libmqttlink_latency_histogram *histogram);
+
 /**
  * Returns the current connection state of the MQTT link.
  * @return Connection state as enum _enum_libmqttlink_connection_state.
  */
 enum _enum_libmqttlink_connection_state libmqttlink_get_connection_state(void);
 
+/**
+ * Configures how the connection to the broker is established. Must be called before connecting.
+ * In async mode the connect and TLS handshake complete in the connection thread's loop and an
+ * attempt is abandoned after connect_timeout_ms. If pre-resolved numeric addresses are given,
+ * TCP connections are opened to all of them in parallel and the first to answer is used, which
+ * skips DNS. The probe connections are closed and mosquitto then connects to the winner, so probing
+ * costs one extra TCP round trip and blocks the connection thread until an address answers. It is
+ * done on the first connect and after a failed attempt; reconnects after a dropped link reuse the
+ * winner. With TLS the broker certificate must be valid for that address.
+ * @param async 1 to connect with mosquitto_connect_async(), 0 for a blocking connect.
+ * @param connect_timeout_ms Connect attempt timeout (0 for none, probing then gives up after 1000 ms).
+ * @param addresses Numeric IPv4/IPv6 addresses of the broker, or NULL.
+ * @param number_of_addresses Number of entries in addresses (up to 16 are probed).
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_set_connect_options(int async, unsigned int connect_timeout_ms, const char *const *addresses, unsigned int number_of_addresses);
+
+/**
+ * Sets a callback invoked on the connection thread each time the connection to the broker is established.
+ * Must be called before connecting.
+ * @param ready_function_ptr Callback function, NULL to remove it.
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_set_ready_callback(void (*ready_function_ptr)(void));
+
+/**
+ * Blocks until the connection to the broker is established or the timeout expires.
+ * @param timeout_ms Maximum time to wait, measured on the monotonic clock (wall clock steps do not affect it).
+ * @return 0 when connected, -1 on timeout.
+ */
+int libmqttlink_wait_ready(unsigned int timeout_ms);
+
+/**
+ * Sets CPU affinity, SCHED_FIFO priority, stack size and name for a library thread role.
+ * Applied when the thread is created, so it must be called before connecting. If the real-time
+ * priority is not permitted (missing CAP_SYS_NICE) the thread starts with default scheduling.
+ * @param role Thread role to configure.
+ * @param config Placement settings. The CPU list and name are copied.
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_set_thread_config(enum _enum_libmqttlink_thread_role role, const struct _struct_libmqttlink_thread_config *config);
+
+/**
+ * Configures payload compression. Payloads of at least min_size bytes are compressed before publishing.
+ * On MQTT 5 links the codec is named in a "libmqttlink-codec" user property, on MQTT 3.1.1 links the
+ * payload starts with a 7 byte header instead. Marked payloads are decompressed before the subscriber
+ * callback; the 3.1.1 header is only recognised while a codec is configured. Both sides must load the
+ * same dictionary. Must be called before connecting.
+ * @param codec Codec to use for publishing (e_libmqttlink_codec_none to disable).
+ * @param level zstd compression level, or lz4 acceleration factor.
+ * @param min_size Payloads smaller than this are sent uncompressed.
+ * @param dictionary Optional pre-trained dictionary (NULL for none). It is copied.
+ * @param dictionary_size Size of the dictionary in bytes.
+ * @return 0 on success, -1 on error or if the codec was not built in.
+ */
+int libmqttlink_set_compression(enum _enum_libmqttlink_codec codec, int level, unsigned int min_size, const void *dictionary, unsigned int dictionary_size);
+
+/**
+ * Enables publish coalescing for topics matching a pattern. Only the latest value per topic is kept;
+ * it is sent once flush_interval_ms has passed since the previous send, or earlier when a numeric
+ * payload moves by more than change_delta. Pending values are flushed by the connection thread;
+ * libmqttlink_shutdown() sends the remaining ones right away if the link is still up.
+ * Calling again with the same pattern updates its settings. Up to 65536 distinct topics are tracked;
+ * topics seen after that are published without coalescing.
+ * @param topic_pattern Topic filter, MQTT wildcards allowed.
+ * @param flush_interval_ms Minimum time between two sends on the same topic.
+ * @param change_delta Numeric change that forces an early send (0 to disable).
+ * @param max_rate_per_sec Token bucket rate cap per topic (0 to disable).
+ * @param burst Token bucket size.
+ * @return 0 on success, -1 on error.
+ */
+int libmqttlink_set_publish_coalescing(const char *topic_pattern, unsigned int flush_interval_ms, double change_delta, double max_rate_per_sec, unsigned int burst);
+
+/**
+ * Returns the publish coalescing counters for a topic pattern.
+ * @param topic_pattern Topic filter given to libmqttlink_set_publish_coalescing().
+ * @param stats Output counters.
+ * @return 0 on success, -1 if the pattern is not configured.
+ */
+int libmqttlink_get_coalescing_stats(const char *topic_pattern, struct _struct_libmqttlink_coalescing_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
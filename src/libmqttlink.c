@@ -1,21 +1,41 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setname_np(), pthread_attr_setaffinity_np()
+#endif
+
 #include "../include/libmqttlink.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <ifaddrs.h>
+#include <math.h>
 #include <mosquitto.h>
 #include <net/if.h>
 #include <netdb.h>
 #include <netpacket/packet.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef MQTTLINK_LZ4
+#include <lz4.h>
+#endif
+#ifdef MQTTLINK_ZSTD
+#include <zstd.h>
+#endif
+#ifdef MQTTLINK_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
 #ifndef NI_MAXHOST
 #define NI_MAXHOST 1025
 #endif
@@ -26,6 +46,43 @@
 #define IFF_LOOPBACK 0x8
 #endif
 
+// Compressed payload header on MQTT 3.1.1 links: 0x00, 'm', codec id, original length (32-bit big endian).
+// Any payload may start with these bytes, so received headers are only parsed when a codec is configured.
+// MQTT 5 links send the bare compressed body and mark it with a "<codec>:<original length>" user property.
+#define CODEC_HEADER_SIZE 7
+#define CODEC_MAGIC_0 0x00
+#define CODEC_MAGIC_1 'm'
+#define CODEC_MAX_PAYLOAD_SIZE 268435455 // MQTT maximum packet size
+#define CODEC_PROPERTY_NAME "libmqttlink-codec"
+
+// Received message held in a batch, offsets point into the batch data buffer
+struct struct_batch_entry
+{
+    size_t topic_offset;
+    size_t payload_offset;
+    unsigned int len;
+    double timestamp;
+};
+
+// Accumulated messages for a batch subscription. Only the connection thread fills and delivers it.
+struct struct_batch_state
+{
+    void (*batch_function_ptr)(const struct _struct_libmqttlink_batch_message *messages, unsigned int count, const char *topic);
+    char topic[1024];
+    unsigned int max_messages;
+    unsigned int max_bytes;
+    unsigned int linger_ms;
+    char *data;
+    size_t data_size;
+    size_t data_capacity;
+    struct struct_batch_entry *entries;
+    struct _struct_libmqttlink_batch_message *messages;
+    unsigned int count;
+    unsigned int capacity;
+    double first_message_time;
+    struct struct_batch_state *next_retired;
+};
+
 // Structure for notification callback and topic
 struct struct_notification_structer
 {
@@ -33,6 +90,79 @@ struct struct_notification_structer
     char topic[1024];
     int qos; // added per-topic QoS
     pthread_t thread_id;
+    struct struct_batch_state *batch; // NULL for per-message subscriptions
+};
+
+// Publish coalescing rule for a topic pattern
+struct struct_coalesce_rule
+{
+    char topic_pattern[1024];
+    unsigned int flush_interval_ms;
+    double change_delta;
+    double max_rate_per_sec; // 0 disables the token bucket
+    double burst;
+    struct _struct_libmqttlink_coalescing_stats stats;
+};
+
+// Latest value held back for a concrete topic, or a cached miss for a topic no rule matches
+struct struct_coalesce_slot
+{
+    char *topic;
+    uint32_t topic_hash;
+    uint32_t rule_index; // COALESCE_NO_RULE for a topic that is not coalesced
+    int qos;
+    char *pending_payload;
+    size_t pending_capacity;
+    bool pending_flag;
+    bool rate_limited_flag; // pending value already counted as rate limited
+    double last_sent_value;
+    bool last_sent_value_valid;
+    double last_send_time;
+    double tokens;
+    double last_refill_time;
+};
+
+// Outstanding request, linked into a timer wheel slot by pool index
+struct struct_rpc_request
+{
+    uint64_t correlation_id;
+    void (*response_function_ptr)(enum _enum_libmqttlink_request_status status, const char *payload, int len, void *user_data);
+    void *user_data;
+    uint64_t expiry_tick; // slot is expiry_tick modulo the wheel size
+    int32_t wheel_slot;
+    int32_t prev;
+    int32_t next; // also links the free list
+};
+
+// Callback collected under the lock and invoked after releasing it
+struct struct_rpc_completion
+{
+    void (*response_function_ptr)(enum _enum_libmqttlink_request_status status, const char *payload, int len, void *user_data);
+    void *user_data;
+};
+
+// Trace ring slot, sequence is odd while a writer fills it
+struct struct_trace_slot
+{
+    _Atomic uint64_t sequence;
+    struct _struct_libmqttlink_trace_span span;
+};
+
+// Broker transit histogram of one topic
+struct struct_trace_topic
+{
+    char topic[1024];
+    struct _struct_libmqttlink_latency_histogram histogram;
+};
+
+// Placement settings for a library thread
+struct struct_thread_config
+{
+    int cpus[64];
+    unsigned int number_of_cpus;
+    int sched_fifo_priority;
+    size_t stack_size;
+    char name[16]; // pthread_setname_np() limit including terminator
 };
 
 // Main MQTT link structure
@@ -59,6 +189,40 @@ struct struct_libmqttlink_struct
     const char *tls_keyfile;
     const char *tls_version;
     int tls_insecure;
+    int tls_session_resumption;
+    const char *tls_ciphers;
+    const char *tls_ciphersuites;
+    const char *tls_groups;
+    // MQTT protocol version, 4 (3.1.1) or 5
+    int protocol_version;
+    // Connect options
+    int connect_async;
+    unsigned int connect_timeout_ms;
+    char **connect_addresses;
+    unsigned int number_of_connect_addresses;
+    void (*ready_function_ptr)(void);
+    // Payload compression
+    enum _enum_libmqttlink_codec codec;
+    int codec_level;
+    unsigned int codec_min_size;
+    void *codec_dictionary;
+    size_t codec_dictionary_size;
+};
+
+// Per-thread codec contexts and reusable payload buffers
+struct struct_codec_thread_state
+{
+    char *compress_buffer;
+    size_t compress_capacity;
+    char *payload_buffer;
+    size_t payload_capacity;
+#ifdef MQTTLINK_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+#ifdef MQTTLINK_LZ4
+    LZ4_stream_t *lz4_stream;
+#endif
 };
 
 // Global variables
@@ -82,13 +246,110 @@ static struct struct_libmqttlink_struct g_libmqttlink_struct = {
     .tls_keyfile = NULL,
     .tls_version = NULL,
     .tls_insecure = 0,
+    .tls_session_resumption = 0,
+    .tls_ciphers = NULL,
+    .tls_ciphersuites = NULL,
+    .tls_groups = NULL,
+    .protocol_version = 4,
+    .connect_async = 0,
+    .connect_timeout_ms = 0,
+    .connect_addresses = NULL,
+    .number_of_connect_addresses = 0,
+    .ready_function_ptr = NULL,
+    .codec = e_libmqttlink_codec_none,
+    .codec_level = 0,
+    .codec_min_size = 0,
+    .codec_dictionary = NULL,
+    .codec_dictionary_size = 0,
 };
 
 static pthread_mutex_t g_mutex_lock;
 static pthread_mutex_t g_state_mutex; // protects connection_state_flag
+static pthread_cond_t g_state_cond; // signaled when the connection comes up, waits use CLOCK_MONOTONIC
+static pthread_once_t g_state_cond_once = PTHREAD_ONCE_INIT;
 static volatile bool subsc_fonk_check_flag = 0;
 static volatile bool g_stop_flag = false; // graceful stop flag
 
+// Publish coalescing tables, configured before or after connect. Slots are found through an
+// open addressing index (topic hash -> slot index + 1, 0 for an empty bucket).
+#define COALESCE_MAX_SLOTS 65536
+#define COALESCE_NO_RULE UINT32_MAX
+static pthread_mutex_t g_coalesce_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool g_coalesce_enabled = false; // publishes skip the mutex until the first rule is added
+static struct struct_coalesce_rule *g_coalesce_rules = NULL;
+static uint16_t g_number_of_coalesce_rules = 0;
+static struct struct_coalesce_slot *g_coalesce_slots = NULL;
+static uint32_t g_number_of_coalesce_slots = 0;
+static uint32_t g_number_of_unmatched_coalesce_slots = 0;
+static uint32_t g_coalesce_slots_capacity = 0;
+static uint32_t *g_coalesce_index = NULL;
+static uint32_t g_coalesce_index_capacity = 0; // power of two
+
+#ifdef MQTTLINK_OPENSSL
+// TLS context shared by all connections, the last session ticket and handshake counters
+static pthread_mutex_t g_tls_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *g_ssl_ctx = NULL;
+static SSL_SESSION *g_tls_session = NULL;
+static double g_tls_handshake_start_time = 0;
+static bool g_tls_handshake_in_progress = false;
+static struct _struct_libmqttlink_tls_stats g_tls_stats = {0};
+#endif
+
+// Request/response correlation: pool of requests, open addressing hash map (correlation id -> pool index)
+// and a timer wheel for timeouts. Advanced by the connection thread.
+#define RPC_WHEEL_SLOTS 512 // power of two
+#define RPC_TICK_MS 10
+static pthread_mutex_t g_rpc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct struct_rpc_request *g_rpc_pool = NULL;
+static uint32_t g_rpc_pool_capacity = 0;
+static int32_t g_rpc_free_head = -1;
+static int32_t *g_rpc_table = NULL; // -1 for an empty bucket
+static uint32_t g_rpc_table_capacity = 0; // power of two
+static uint32_t g_rpc_outstanding = 0;
+static int32_t g_rpc_wheel[RPC_WHEEL_SLOTS];
+static uint64_t g_rpc_current_tick = 0;
+static uint64_t g_rpc_next_correlation_id = 0;
+static char g_rpc_reply_topic[320] = "";
+
+// Properties of the message whose subscriber callback is running on this thread, for libmqttlink_respond()
+static __thread const mosquitto_property *g_current_message_properties = NULL;
+
+// Tracing: sampled spans in a lock-free ring, per-topic transit histograms
+#define TRACE_PROPERTY_NAME "libmqttlink-sent-ns"
+#define TRACE_MAX_TOPICS 1024
+static struct struct_trace_slot *g_trace_ring = NULL;
+static uint32_t g_trace_ring_size = 0; // power of two
+static _Atomic uint64_t g_trace_head = 0;
+static _Atomic uint64_t g_trace_sample_counters[2] = {0, 0}; // per trace kind
+static unsigned int g_trace_sample_every = 0; // 0 disables tracing
+static pthread_mutex_t g_trace_mutex = PTHREAD_MUTEX_INITIALIZER; // protects the topic histograms
+static struct struct_trace_topic *g_trace_topics = NULL;
+static uint16_t g_number_of_trace_topics = 0;
+static __thread bool g_trace_stamp_publish = false; // publish_payload() adds the send time property
+static __thread struct _struct_libmqttlink_trace_span *g_current_trace_span = NULL;
+
+// Thread placement per role, set by libmqttlink_set_thread_config()
+static struct struct_thread_config g_thread_config[e_libmqttlink_thread_role_count] = {
+    [e_libmqttlink_thread_role_network] = {.name = "mqttlink-net"},
+};
+
+// Batch states of removed subscriptions, freed by the connection thread
+static struct struct_batch_state *g_retired_batches = NULL;
+// Batches whose linger time expired, collected by batch_flush()
+static struct struct_batch_state **g_due_batches = NULL;
+static uint16_t g_due_batches_capacity = 0;
+
+// Payload codec state, prepared by libmqttlink_set_compression()
+static pthread_key_t g_codec_thread_key;
+static pthread_once_t g_codec_thread_once = PTHREAD_ONCE_INIT;
+#ifdef MQTTLINK_ZSTD
+static ZSTD_CDict *g_zstd_cdict = NULL;
+static ZSTD_DDict *g_zstd_ddict = NULL;
+#endif
+#ifdef MQTTLINK_LZ4
+static LZ4_stream_t *g_lz4_dict_stream = NULL;
+#endif
+
 static char *strdup_safe(const char *src)
 {
     if (!src) return NULL;
@@ -132,6 +393,31 @@ static void generate_client_id(char *id, size_t len)
         snprintf(id, len, "libmqttlink-%ld-%d", now, pid);
 }
 
+static char g_client_id[256];
+static pthread_once_t g_client_id_once = PTHREAD_ONCE_INIT;
+
+static void generate_cached_client_id(void)
+{
+    generate_client_id(g_client_id, sizeof(g_client_id));
+}
+
+// Internal: Client id derived once per process, getifaddrs() is not walked again on later connects.
+static const char *get_client_id(void)
+{
+    pthread_once(&g_client_id_once, generate_cached_client_id);
+    return g_client_id;
+}
+
+static void state_cond_init(void)
+{
+    // wall clock steps (NTP/chrony right after boot) must not shorten or stretch libmqttlink_wait_ready()
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_state_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
 static void sleep_milisec(unsigned int milisec)
 {
     usleep(milisec * 1000);
@@ -145,247 +431,1747 @@ static double get_system_time(void)
     return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
 }
 
-// Internal: Dispatch received messages to the correct callback (thread-safe)
-static void message_received_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+static double get_monotonic_time(void)
 {
-    (void)mosq;
-    (void)obj;
-    void (*cb)(const char *, const char *) = NULL;
-    
-    // Create null-terminated copy of payload (msg->payload may not be null-terminated)
-    char *payload_copy = NULL;
-    if (msg->payload && msg->payloadlen > 0)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        return 0;
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void codec_thread_state_free(void *arg)
+{
+    struct struct_codec_thread_state *state = arg;
+    if (!state)
+        return;
+    free(state->compress_buffer);
+    free(state->payload_buffer);
+#ifdef MQTTLINK_ZSTD
+    ZSTD_freeCCtx(state->zstd_cctx);
+    ZSTD_freeDCtx(state->zstd_dctx);
+#endif
+#ifdef MQTTLINK_LZ4
+    if (state->lz4_stream)
+        LZ4_freeStream(state->lz4_stream);
+#endif
+    free(state);
+}
+
+static void codec_thread_key_create(void)
+{
+    pthread_key_create(&g_codec_thread_key, codec_thread_state_free);
+}
+
+// Internal: Returns the calling thread's codec state, creating it on first use.
+static struct struct_codec_thread_state *get_codec_thread_state(void)
+{
+    pthread_once(&g_codec_thread_once, codec_thread_key_create);
+    struct struct_codec_thread_state *state = pthread_getspecific(g_codec_thread_key);
+    if (state)
+        return state;
+    state = calloc(1, sizeof(*state));
+    if (state && pthread_setspecific(g_codec_thread_key, state) != 0)
     {
-        payload_copy = (char *)malloc(msg->payloadlen + 1);
-        if (payload_copy)
-        {
-            memcpy(payload_copy, msg->payload, msg->payloadlen);
-            payload_copy[msg->payloadlen] = '\0';
-        }
+        free(state);
+        state = NULL;
     }
-    else
+    return state;
+}
+
+static int reserve_buffer(char **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+        return 0;
+    char *tmp = realloc(*buffer, size);
+    if (!tmp)
+        return -1;
+    *buffer = tmp;
+    *capacity = size;
+    return 0;
+}
+
+// Internal: Compresses a payload if a codec is configured and it pays off.
+// On return *out points either at payload or at the thread's compress buffer.
+static void codec_encode(struct struct_codec_thread_state *state, const char *payload, size_t len, const char **out, size_t *out_len)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    *out = payload;
+    *out_len = len;
+    if (ptr->codec == e_libmqttlink_codec_none || len < ptr->codec_min_size || len > CODEC_MAX_PAYLOAD_SIZE || state == NULL)
+        return;
+
+    size_t bound = 0;
+#ifdef MQTTLINK_ZSTD
+    if (ptr->codec == e_libmqttlink_codec_zstd)
+        bound = ZSTD_compressBound(len);
+#endif
+#ifdef MQTTLINK_LZ4
+    if (ptr->codec == e_libmqttlink_codec_lz4)
+        bound = (size_t)LZ4_compressBound((int)len);
+#endif
+    if (bound == 0 || reserve_buffer(&state->compress_buffer, &state->compress_capacity, CODEC_HEADER_SIZE + bound) != 0)
+        return;
+
+    char *dst = state->compress_buffer + CODEC_HEADER_SIZE;
+    size_t compressed = 0;
+    (void)dst; // unused when built without codecs
+#ifdef MQTTLINK_ZSTD
+    if (ptr->codec == e_libmqttlink_codec_zstd)
     {
-        payload_copy = strdup_safe("");
+        if (!state->zstd_cctx && !(state->zstd_cctx = ZSTD_createCCtx()))
+            return;
+        size_t rc = g_zstd_cdict ? ZSTD_compress_usingCDict(state->zstd_cctx, dst, bound, payload, len, g_zstd_cdict)
+                                 : ZSTD_compressCCtx(state->zstd_cctx, dst, bound, payload, len, ptr->codec_level);
+        if (ZSTD_isError(rc))
+        {
+            printf("%s(): zstd compression failed: %s\n", __func__, ZSTD_getErrorName(rc));
+            return;
+        }
+        compressed = rc;
     }
-    
-    // lock while searching list
-    pthread_mutex_lock(&g_mutex_lock);
-    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
-    uint16_t n = ptr->number_of_notification_structer;
-    for (uint16_t i = 0; i < n; i++)
+#endif
+#ifdef MQTTLINK_LZ4
+    if (ptr->codec == e_libmqttlink_codec_lz4)
     {
-        if (!strcmp(ptr->notification_structer_ptr[i].topic, msg->topic))
+        int acceleration = ptr->codec_level > 0 ? ptr->codec_level : 1;
+        int rc;
+        if (g_lz4_dict_stream)
         {
-            cb = ptr->notification_structer_ptr[i].notification_function_ptr;
-            break;
+            if (!state->lz4_stream && !(state->lz4_stream = LZ4_createStream()))
+                return;
+            // copy the preloaded dictionary state, LZ4_attach_dictionary() is not exported by shared liblz4
+            memcpy(state->lz4_stream, g_lz4_dict_stream, sizeof(LZ4_stream_t));
+            rc = LZ4_compress_fast_continue(state->lz4_stream, payload, dst, (int)len, (int)bound, acceleration);
+        }
+        else
+        {
+            rc = LZ4_compress_fast(payload, dst, (int)len, (int)bound, acceleration);
+        }
+        if (rc <= 0)
+        {
+            printf("%s(): lz4 compression failed.\n", __func__);
+            return;
         }
+        compressed = (size_t)rc;
     }
-    pthread_mutex_unlock(&g_mutex_lock);
-    if (cb && payload_copy)
-        cb(payload_copy, msg->topic);
-    free(payload_copy);
+#endif
+    if (CODEC_HEADER_SIZE + compressed >= len)
+        return; // not worth it, send as is
+
+    unsigned char *header = (unsigned char *)state->compress_buffer;
+    header[0] = CODEC_MAGIC_0;
+    header[1] = CODEC_MAGIC_1;
+    header[2] = (unsigned char)ptr->codec;
+    header[3] = (unsigned char)(len >> 24);
+    header[4] = (unsigned char)(len >> 16);
+    header[5] = (unsigned char)(len >> 8);
+    header[6] = (unsigned char)len;
+    *out = state->compress_buffer;
+    *out_len = CODEC_HEADER_SIZE + compressed;
 }
 
-// Internal: Connection callback
-static void connection_callback(struct mosquitto *mosq, void *obj, int result)
+// Internal: Returns a copy of the value of a user property, NULL if the property is not present. Caller frees it.
+static char *get_user_property(const mosquitto_property *properties, const char *name)
 {
-    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
-    pthread_mutex_lock(&g_state_mutex);
-    if (result == 0)
+    const mosquitto_property *property = properties;
+    bool skip_first = false;
+    while (property)
     {
-        ptr->connection_state_flag = e_libmqttlink_connection_state_connection_true;
-        pthread_mutex_unlock(&g_state_mutex);
-        printf("%s(): Connection to Mosquitto server established.\n", __func__);
-        return;
+        char *key = NULL, *value = NULL;
+        property = mosquitto_property_read_string_pair(property, MQTT_PROP_USER_PROPERTY, &key, &value, skip_first);
+        bool found = property && key && value && !strcmp(key, name);
+        free(key);
+        if (found)
+            return value;
+        free(value);
+        skip_first = true;
     }
-    ptr->connection_state_flag = e_libmqttlink_connection_state_connection_false;
-    pthread_mutex_unlock(&g_state_mutex);
-    printf("%s(): Connection to Mosquitto server failed. Reason: [%s]\n", __func__, mosquitto_strerror(result));
+    return NULL;
 }
 
-// Internal: Subscribe to all registered topics
-static int subscribe_all_topics(void)
+static const char *codec_name(enum _enum_libmqttlink_codec codec)
 {
-    uint16_t subs_counter = 0;
-    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
-    const int MAX_ATTEMPTS = 10;
-    int attempts = 0;
-    while (attempts < MAX_ATTEMPTS)
-    {
-        subs_counter = 0;
-        pthread_mutex_lock(&g_mutex_lock);
-        for (uint16_t i = 0; i < ptr->number_of_notification_structer; ++i)
-        {
-            int *mid = NULL;
-            int qos = ptr->notification_structer_ptr[i].qos;
-            int result = mosquitto_subscribe(ptr->mosquitto_structer_ptr, mid, ptr->notification_structer_ptr[i].topic, qos);
-            if (result != MOSQ_ERR_SUCCESS)
-            {
-                printf("%s(): Could not subscribe to topic [%s]. Reason: [%s]\n", __func__, ptr->notification_structer_ptr[i].topic, mosquitto_strerror(result));
-            }
-            else
-            {
-                printf("%s(): Subscribed to topic [%s].\n", __func__, ptr->notification_structer_ptr[i].topic);
-                subs_counter++;
-            }
-        }
-        pthread_mutex_unlock(&g_mutex_lock);
-        if (subs_counter == ptr->number_of_notification_structer)
-            return 0;
-        attempts++;
-        sleep_milisec(500 + attempts * 200);
-    }
-    printf("%s(): Failed to subscribe all topics after %d attempts.\n", __func__, MAX_ATTEMPTS);
-    return -1;
+    return codec == e_libmqttlink_codec_lz4 ? "lz4" : codec == e_libmqttlink_codec_zstd ? "zstd" : "none";
 }
 
-// Internal: Unsubscribe from all topics
-static int unsubscribe_all_topics(void)
+// Internal: Copies or decompresses a received payload into the thread's payload buffer, null-terminated.
+// The codec comes from the MQTT 5 codec property, or from the in-band header if a codec is configured.
+// Returns the payload length, -1 on error.
+static long codec_decode(struct struct_codec_thread_state *state, const void *payload, size_t len, const mosquitto_property *properties, const char **out)
 {
-    uint16_t unsubs_counter = 0;
-    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
-    const int MAX_ATTEMPTS = 10;
-    int attempts = 0;
-    while (attempts < MAX_ATTEMPTS)
+    const unsigned char *src = payload;
+    int codec = e_libmqttlink_codec_none;
+    size_t original = 0;
+    const char *body = payload;
+    size_t body_len = len;
+    char *marker = properties ? get_user_property(properties, CODEC_PROPERTY_NAME) : NULL;
+    if (marker)
     {
-        unsubs_counter = 0;
-        pthread_mutex_lock(&g_mutex_lock);
-        for (uint16_t i = 0; i < ptr->number_of_notification_structer; ++i)
+        char name[8] = "";
+        unsigned long long size = 0;
+        codec = -1; // marked but unknown
+        if (sscanf(marker, "%7[a-z0-9]:%llu", name, &size) == 2)
         {
-            int *mid = NULL;
-            int result = mosquitto_unsubscribe(ptr->mosquitto_structer_ptr, mid, ptr->notification_structer_ptr[i].topic);
-            if (result != MOSQ_ERR_SUCCESS)
-            {
-                printf("%s(): Could not unsubscribe from topic [%s]. Reason: [%s]\n", __func__, ptr->notification_structer_ptr[i].topic, mosquitto_strerror(result));
-            }
-            else
-            {
-                printf("%s(): Unsubscribed from topic [%s].\n", __func__, ptr->notification_structer_ptr[i].topic);
-                unsubs_counter++;
-            }
+            if (!strcmp(name, codec_name(e_libmqttlink_codec_lz4)))
+                codec = e_libmqttlink_codec_lz4;
+            else if (!strcmp(name, codec_name(e_libmqttlink_codec_zstd)))
+                codec = e_libmqttlink_codec_zstd;
+            original = size <= CODEC_MAX_PAYLOAD_SIZE ? (size_t)size : SIZE_MAX;
         }
-        pthread_mutex_unlock(&g_mutex_lock);
-        if (unsubs_counter == ptr->number_of_notification_structer)
-            return 0;
-        attempts++;
-        sleep_milisec(300 + attempts * 150);
+        free(marker);
     }
-    printf("%s(): Failed to unsubscribe all topics after %d attempts.\n", __func__, MAX_ATTEMPTS);
-    return -1;
+    else if (g_libmqttlink_struct.codec != e_libmqttlink_codec_none && len >= CODEC_HEADER_SIZE && src[0] == CODEC_MAGIC_0 && src[1] == CODEC_MAGIC_1 &&
+             (src[2] == e_libmqttlink_codec_lz4 || src[2] == e_libmqttlink_codec_zstd))
+    {
+        codec = src[2];
+        original = ((size_t)src[3] << 24) | ((size_t)src[4] << 16) | ((size_t)src[5] << 8) | (size_t)src[6];
+        body = (const char *)src + CODEC_HEADER_SIZE;
+        body_len = len - CODEC_HEADER_SIZE;
+    }
+
+    if (codec == e_libmqttlink_codec_none)
+    {
+        if (reserve_buffer(&state->payload_buffer, &state->payload_capacity, len + 1) != 0)
+            return -1;
+        if (len)
+            memcpy(state->payload_buffer, payload, len);
+        state->payload_buffer[len] = '\0';
+        *out = state->payload_buffer;
+        return (long)len;
+    }
+
+    if (original > CODEC_MAX_PAYLOAD_SIZE || reserve_buffer(&state->payload_buffer, &state->payload_capacity, original + 1) != 0)
+        return -1;
+    long decoded = -1;
+    (void)body; // unused when built without codecs
+    (void)body_len;
+    switch (codec)
+    {
+#ifdef MQTTLINK_ZSTD
+    case e_libmqttlink_codec_zstd:
+    {
+        if (!state->zstd_dctx && !(state->zstd_dctx = ZSTD_createDCtx()))
+            return -1;
+        size_t rc = g_zstd_ddict ? ZSTD_decompress_usingDDict(state->zstd_dctx, state->payload_buffer, original, body, body_len, g_zstd_ddict)
+                                 : ZSTD_decompressDCtx(state->zstd_dctx, state->payload_buffer, original, body, body_len);
+        if (ZSTD_isError(rc))
+            printf("%s(): zstd decompression failed: %s\n", __func__, ZSTD_getErrorName(rc));
+        else
+            decoded = (long)rc;
+        break;
+    }
+#endif
+#ifdef MQTTLINK_LZ4
+    case e_libmqttlink_codec_lz4:
+    {
+        struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+        int rc = ptr->codec_dictionary ? LZ4_decompress_safe_usingDict(body, state->payload_buffer, (int)body_len, (int)original, ptr->codec_dictionary, (int)ptr->codec_dictionary_size)
+                                       : LZ4_decompress_safe(body, state->payload_buffer, (int)body_len, (int)original);
+        if (rc < 0)
+            printf("%s(): lz4 decompression failed.\n", __func__);
+        else
+            decoded = rc;
+        break;
+    }
+#endif
+    default:
+        printf("%s(): Unsupported codec [%d].\n", __func__, codec);
+        break;
+    }
+    if (decoded != (long)original)
+        return -1;
+    state->payload_buffer[original] = '\0';
+    *out = state->payload_buffer;
+    return decoded;
 }
 
-// Internal: Thread function to manage connection and periodic restart
-static void *connection_state_thread(void *login_info_ptr)
+static long long get_monotonic_time_ns(void)
 {
-    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
-    mosquitto_lib_init();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    bool clean_session = false;
-    char id[256];
+static long long get_realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    generate_client_id(id, sizeof(id));
+// Internal: Returns true if the current message should be traced.
+static bool trace_sample(enum _enum_libmqttlink_trace_kind kind)
+{
+    unsigned int every = g_trace_sample_every;
+    if (every == 0 || g_trace_ring == NULL)
+        return false;
+    return atomic_fetch_add_explicit(&g_trace_sample_counters[kind], 1, memory_order_relaxed) % every == 0;
+}
 
-    void *obj = NULL;
-    ptr->mosquitto_structer_ptr = mosquitto_new(id, clean_session, obj);
-    if (ptr->mosquitto_structer_ptr == NULL)
+// Internal: Appends a span to the ring, overwriting the oldest. Safe from any thread without locking.
+static void trace_push(const struct _struct_libmqttlink_trace_span *span)
+{
+    uint64_t index = atomic_fetch_add_explicit(&g_trace_head, 1, memory_order_relaxed);
+    struct struct_trace_slot *slot = &g_trace_ring[index & (g_trace_ring_size - 1)];
+    atomic_store_explicit(&slot->sequence, 2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->span = *span;
+    atomic_store_explicit(&slot->sequence, 2 * index + 2, memory_order_release);
+}
+
+// Internal: Records a publish span ending now.
+static void trace_push_publish(const char *topic, long long start_ns)
+{
+    struct _struct_libmqttlink_trace_span span = {0};
+    span.kind = e_libmqttlink_trace_kind_publish;
+    snprintf(span.topic, sizeof(span.topic), "%s", topic);
+    span.start_ns = start_ns;
+    span.end_ns = get_monotonic_time_ns();
+    span.transit_ns = -1;
+    trace_push(&span);
+}
+
+// Internal: Adds a broker transit sample to the topic's histogram. Called from the connection thread.
+static void trace_record_transit(const char *topic, long long transit_ns)
+{
+    double transit_us = transit_ns / 1000.0;
+    unsigned int bucket = 0;
+    if (transit_us >= 1.0)
     {
-        printf("%s(): Failed to start Mosquitto library. Memory error.\n", __func__);
-        mosquitto_lib_cleanup();
-        pthread_exit(NULL);
+        bucket = (unsigned int)log2(transit_us) + 1;
+        if (bucket >= LIBMQTTLINK_HISTOGRAM_BUCKETS)
+            bucket = LIBMQTTLINK_HISTOGRAM_BUCKETS - 1;
     }
 
-    // Apply Will if configured
-    if (ptr->will_topic && ptr->will_payload)
+    pthread_mutex_lock(&g_trace_mutex);
+    struct struct_trace_topic *entry = NULL;
+    for (uint16_t i = 0; i < g_number_of_trace_topics; ++i)
     {
-        int rc = mosquitto_will_set(ptr->mosquitto_structer_ptr, ptr->will_topic, (int)strlen(ptr->will_payload), ptr->will_payload, ptr->will_qos, ptr->will_retain);
-        if (rc != MOSQ_ERR_SUCCESS)
-            printf("%s(): Failed to set will: %s\n", __func__, mosquitto_strerror(rc));
+        if (!strcmp(g_trace_topics[i].topic, topic))
+        {
+            entry = &g_trace_topics[i];
+            break;
+        }
     }
-
-    // Apply TLS if configured
-    if (ptr->tls_cafile || ptr->tls_capath || ptr->tls_certfile || ptr->tls_keyfile)
+    size_t tlen = strlen(topic);
+    if (entry == NULL && g_number_of_trace_topics < TRACE_MAX_TOPICS && tlen < sizeof(entry->topic))
     {
-        int rc = mosquitto_tls_set(ptr->mosquitto_structer_ptr, ptr->tls_cafile, ptr->tls_capath, ptr->tls_certfile, ptr->tls_keyfile, NULL);
-        if (rc != MOSQ_ERR_SUCCESS)
-            printf("%s(): Failed to set TLS: %s\n", __func__, mosquitto_strerror(rc));
-        if (ptr->tls_insecure)
-            mosquitto_tls_insecure_set(ptr->mosquitto_structer_ptr, true);
-        if (ptr->tls_version)
+        struct struct_trace_topic *tmp = realloc(g_trace_topics, (g_number_of_trace_topics + 1) * sizeof(*tmp));
+        if (tmp)
         {
-            rc = mosquitto_tls_opts_set(ptr->mosquitto_structer_ptr, 1, ptr->tls_version, NULL);
-            if (rc != MOSQ_ERR_SUCCESS)
-                printf("%s(): Failed to set TLS opts: %s\n", __func__, mosquitto_strerror(rc));
+            g_trace_topics = tmp;
+            entry = &g_trace_topics[g_number_of_trace_topics++];
+            memset(entry, 0, sizeof(*entry));
+            memcpy(entry->topic, topic, tlen + 1);
         }
     }
+    if (entry)
+    {
+        struct _struct_libmqttlink_latency_histogram *histogram = &entry->histogram;
+        if (histogram->count == 0 || transit_us < histogram->min_us)
+            histogram->min_us = transit_us;
+        if (histogram->count == 0 || transit_us > histogram->max_us)
+            histogram->max_us = transit_us;
+        histogram->sum_us += transit_us;
+        histogram->count++;
+        histogram->buckets[bucket]++;
+    }
+    pthread_mutex_unlock(&g_trace_mutex);
+}
+
+// Internal: Reads the sender's time stamp property. Returns 0 if the message carries none.
+static long long trace_read_send_time(const mosquitto_property *properties)
+{
+    char *value = properties ? get_user_property(properties, TRACE_PROPERTY_NAME) : NULL;
+    long long send_time_ns = value ? strtoll(value, NULL, 10) : 0;
+    free(value);
+    return send_time_ns;
+}
+
+// Internal: Encodes and hands a payload to mosquitto. properties is only used on MQTT 5 links.
+static int publish_payload(const char *topic, const char *payload, size_t len, int qos, const mosquitto_property *properties)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    const char *out = payload;
+    size_t out_len = len;
+    if (ptr->codec != e_libmqttlink_codec_none)
+        codec_encode(get_codec_thread_state(), payload, len, &out, &out_len);
+    bool compressed = (out != payload);
+    bool stamped = g_trace_stamp_publish;
+    if (ptr->protocol_version != 5 || (!compressed && !stamped))
+    {
+        if (properties)
+            return mosquitto_publish_v5(ptr->mosquitto_structer_ptr, NULL, topic, (int)out_len, out, qos, 0, properties);
+        return mosquitto_publish(ptr->mosquitto_structer_ptr, NULL, topic, (int)out_len, out, qos, 0);
+    }
+
+    // MQTT 5: codec marker and send time travel as user properties next to the caller's properties
+    mosquitto_property *own_properties = NULL;
+    int result = mosquitto_property_copy_all(&own_properties, properties);
+    if (result == MOSQ_ERR_SUCCESS && compressed)
+    {
+        char value[32];
+        snprintf(value, sizeof(value), "%s:%zu", codec_name(ptr->codec), len);
+        out += CODEC_HEADER_SIZE;
+        out_len -= CODEC_HEADER_SIZE;
+        result = mosquitto_property_add_string_pair(&own_properties, MQTT_PROP_USER_PROPERTY, CODEC_PROPERTY_NAME, value);
+    }
+    if (result == MOSQ_ERR_SUCCESS && stamped)
+    {
+        // send time for the receiver's broker transit measurement
+        char value[24];
+        snprintf(value, sizeof(value), "%lld", get_realtime_ns());
+        result = mosquitto_property_add_string_pair(&own_properties, MQTT_PROP_USER_PROPERTY, TRACE_PROPERTY_NAME, value);
+    }
+    if (result == MOSQ_ERR_SUCCESS)
+        result = mosquitto_publish_v5(ptr->mosquitto_structer_ptr, NULL, topic, (int)out_len, out, qos, 0, own_properties);
+    mosquitto_property_free_all(&own_properties);
+    return result;
+}
+
+static void batch_state_free(struct struct_batch_state *batch)
+{
+    if (!batch)
+        return;
+    free(batch->data);
+    free(batch->entries);
+    free(batch->messages);
+    free(batch);
+}
+
+// Internal: Appends a message to a batch. Returns true if a limit was reached. Caller holds g_mutex_lock.
+static bool batch_append(struct struct_batch_state *batch, const char *topic, const char *payload, size_t len)
+{
+    if (batch->count == batch->capacity)
+    {
+        unsigned int capacity = batch->capacity ? batch->capacity * 2 : 64;
+        struct struct_batch_entry *entries = realloc(batch->entries, capacity * sizeof(*entries));
+        if (entries)
+            batch->entries = entries;
+        struct _struct_libmqttlink_batch_message *messages = realloc(batch->messages, capacity * sizeof(*messages));
+        if (messages)
+            batch->messages = messages;
+        if (!entries || !messages)
+        {
+            printf("%s(): realloc() failed. Message on topic [%s] dropped.\n", __func__, topic);
+            return batch->count > 0;
+        }
+        batch->capacity = capacity;
+    }
+
+    size_t tlen = strlen(topic) + 1;
+    size_t needed = batch->data_size + tlen + len + 1;
+    if (needed > batch->data_capacity)
+    {
+        size_t capacity = batch->data_capacity ? batch->data_capacity : 4096;
+        while (capacity < needed)
+            capacity *= 2;
+        if (reserve_buffer(&batch->data, &batch->data_capacity, capacity) != 0)
+        {
+            printf("%s(): realloc() failed. Message on topic [%s] dropped.\n", __func__, topic);
+            return batch->count > 0;
+        }
+    }
+
+    struct struct_batch_entry *entry = &batch->entries[batch->count];
+    entry->topic_offset = batch->data_size;
+    memcpy(batch->data + batch->data_size, topic, tlen);
+    batch->data_size += tlen;
+    entry->payload_offset = batch->data_size;
+    memcpy(batch->data + batch->data_size, payload, len);
+    batch->data[batch->data_size + len] = '\0';
+    batch->data_size += len + 1;
+    entry->len = (unsigned int)len;
+    entry->timestamp = get_system_time();
+    if (batch->count == 0)
+        batch->first_message_time = get_monotonic_time();
+    batch->count++;
+
+    return (batch->max_messages && batch->count >= batch->max_messages) || (batch->max_bytes && batch->data_size >= batch->max_bytes);
+}
+
+// Internal: Hands the accumulated messages to the batch handler and resets the batch, keeping its memory.
+// Called from the connection thread without g_mutex_lock held.
+static void batch_deliver(struct struct_batch_state *batch)
+{
+    if (batch->count == 0)
+        return;
+    for (unsigned int i = 0; i < batch->count; ++i)
+    {
+        batch->messages[i].topic = batch->data + batch->entries[i].topic_offset;
+        batch->messages[i].payload = batch->data + batch->entries[i].payload_offset;
+        batch->messages[i].len = batch->entries[i].len;
+        batch->messages[i].timestamp = batch->entries[i].timestamp;
+    }
+    batch->batch_function_ptr(batch->messages, batch->count, batch->topic);
+    batch->count = 0;
+    batch->data_size = 0;
+}
+
+// Internal: Delivers batches whose linger time expired, or every non-empty batch on a final flush, and frees
+// retired batches. Called from the connection thread.
+static void batch_flush(bool final_flush)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    uint16_t number_of_due = 0;
+    double now = get_monotonic_time();
+
+    pthread_mutex_lock(&g_mutex_lock);
+    struct struct_batch_state *retired = g_retired_batches;
+    g_retired_batches = NULL;
+    if (g_due_batches_capacity < ptr->number_of_notification_structer)
+    {
+        struct struct_batch_state **tmp = realloc(g_due_batches, ptr->number_of_notification_structer * sizeof(*tmp));
+        if (tmp)
+        {
+            g_due_batches = tmp;
+            g_due_batches_capacity = ptr->number_of_notification_structer;
+        }
+    }
+    for (uint16_t i = 0; i < ptr->number_of_notification_structer && number_of_due < g_due_batches_capacity; ++i)
+    {
+        struct struct_batch_state *batch = ptr->notification_structer_ptr[i].batch;
+        if (batch && batch->count && (final_flush || (batch->linger_ms && (now - batch->first_message_time) * 1000.0 >= batch->linger_ms)))
+            g_due_batches[number_of_due++] = batch;
+    }
+    pthread_mutex_unlock(&g_mutex_lock);
+
+    // retired batches are no longer reachable from the subscription list
+    while (retired)
+    {
+        struct struct_batch_state *next = retired->next_retired;
+        batch_deliver(retired);
+        batch_state_free(retired);
+        retired = next;
+    }
+    // batches collected above are only freed by this thread, after being retired
+    for (uint16_t i = 0; i < number_of_due; ++i)
+        batch_deliver(g_due_batches[i]);
+}
+
+static uint32_t rpc_hash(uint64_t id)
+{
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return (uint32_t)id;
+}
+
+// Internal: Returns the hash bucket holding id, or the empty bucket where it would go. Caller holds g_rpc_mutex.
+static uint32_t rpc_table_find(uint64_t id)
+{
+    uint32_t mask = g_rpc_table_capacity - 1;
+    uint32_t bucket = rpc_hash(id) & mask;
+    while (g_rpc_table[bucket] != -1 && g_rpc_pool[g_rpc_table[bucket]].correlation_id != id)
+        bucket = (bucket + 1) & mask;
+    return bucket;
+}
+
+// Internal: Removes a bucket with backward shift deletion, no tombstones. Caller holds g_rpc_mutex.
+static void rpc_table_remove(uint32_t bucket)
+{
+    uint32_t mask = g_rpc_table_capacity - 1;
+    uint32_t hole = bucket;
+    uint32_t next = (hole + 1) & mask;
+    while (g_rpc_table[next] != -1)
+    {
+        uint32_t home = rpc_hash(g_rpc_pool[g_rpc_table[next]].correlation_id) & mask;
+        // move the entry into the hole unless its home lies cyclically in (hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            g_rpc_table[hole] = g_rpc_table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    g_rpc_table[hole] = -1;
+}
+
+// Internal: Grows the pool and hash map so one more request fits. Caller holds g_rpc_mutex.
+static int rpc_reserve(void)
+{
+    if (g_rpc_free_head == -1)
+    {
+        uint32_t capacity = g_rpc_pool_capacity ? g_rpc_pool_capacity * 2 : 256;
+        struct struct_rpc_request *pool = realloc(g_rpc_pool, capacity * sizeof(*pool));
+        if (!pool)
+            return -1;
+        for (uint32_t i = g_rpc_pool_capacity; i < capacity; ++i)
+            pool[i].next = (i + 1 < capacity) ? (int32_t)(i + 1) : -1;
+        g_rpc_free_head = (int32_t)g_rpc_pool_capacity;
+        g_rpc_pool = pool;
+        g_rpc_pool_capacity = capacity;
+    }
+
+    if ((g_rpc_outstanding + 1) * 2 > g_rpc_table_capacity)
+    {
+        uint32_t capacity = g_rpc_table_capacity ? g_rpc_table_capacity * 2 : 512;
+        int32_t *table = malloc(capacity * sizeof(*table));
+        if (!table)
+            return -1;
+        memset(table, 0xff, capacity * sizeof(*table));
+        int32_t *old = g_rpc_table;
+        uint32_t old_capacity = g_rpc_table_capacity;
+        g_rpc_table = table;
+        g_rpc_table_capacity = capacity;
+        for (uint32_t i = 0; i < old_capacity; ++i)
+        {
+            if (old[i] != -1)
+                g_rpc_table[rpc_table_find(g_rpc_pool[old[i]].correlation_id)] = old[i];
+        }
+        free(old);
+    }
+    return 0;
+}
+
+// Internal: Unlinks a request from its wheel slot and returns it to the free list. Caller holds g_rpc_mutex.
+static void rpc_release(int32_t index)
+{
+    struct struct_rpc_request *request = &g_rpc_pool[index];
+    if (request->prev != -1)
+        g_rpc_pool[request->prev].next = request->next;
+    else
+        g_rpc_wheel[request->wheel_slot] = request->next;
+    if (request->next != -1)
+        g_rpc_pool[request->next].prev = request->prev;
+    request->next = g_rpc_free_head;
+    g_rpc_free_head = index;
+    g_rpc_outstanding--;
+}
+
+// Clock of the timeout wheel, the internal checks replace it to step time deterministically
+static double (*g_rpc_clock)(void) = get_monotonic_time;
+
+static uint64_t rpc_tick_now(void)
+{
+    return (uint64_t)(g_rpc_clock() * (1000.0 / RPC_TICK_MS));
+}
+
+// Internal: Takes a request from the free list, links it into its wheel slot and the hash map.
+// Caller holds g_rpc_mutex and reserved room with rpc_reserve().
+static int32_t rpc_insert(uint64_t id, unsigned int timeout_ms,
+                          void (*response_function_ptr)(enum _enum_libmqttlink_request_status status, const char *payload, int len, void *user_data), void *user_data)
+{
+    int32_t index = g_rpc_free_head;
+    struct struct_rpc_request *request = &g_rpc_pool[index];
+    g_rpc_free_head = request->next;
+
+    uint64_t ticks = (timeout_ms + RPC_TICK_MS - 1) / RPC_TICK_MS;
+    if (ticks == 0)
+        ticks = 1;
+    uint64_t expiry_tick = rpc_tick_now() + ticks;
+    if (expiry_tick <= g_rpc_current_tick)
+        expiry_tick = g_rpc_current_tick + 1;
+    request->correlation_id = id;
+    request->response_function_ptr = response_function_ptr;
+    request->user_data = user_data;
+    request->expiry_tick = expiry_tick;
+    request->wheel_slot = (int32_t)(expiry_tick & (RPC_WHEEL_SLOTS - 1));
+    request->prev = -1;
+    request->next = g_rpc_wheel[request->wheel_slot];
+    if (request->next != -1)
+        g_rpc_pool[request->next].prev = index;
+    g_rpc_wheel[request->wheel_slot] = index;
+    g_rpc_table[rpc_table_find(id)] = index;
+    g_rpc_outstanding++;
+    return index;
+}
+
+// Internal: Expires requests whose timeout passed. Called from the connection thread.
+static void rpc_expire_due(void)
+{
+    struct struct_rpc_completion *expired = NULL;
+    size_t number_of_expired = 0, expired_capacity = 0;
+
+    pthread_mutex_lock(&g_rpc_mutex);
+    if (g_rpc_outstanding == 0)
+    {
+        g_rpc_current_tick = rpc_tick_now();
+        pthread_mutex_unlock(&g_rpc_mutex);
+        return;
+    }
+    uint64_t now_tick = rpc_tick_now();
+    if (now_tick - g_rpc_current_tick > RPC_WHEEL_SLOTS)
+        g_rpc_current_tick = now_tick - RPC_WHEEL_SLOTS; // one full turn visits every slot
+    bool out_of_memory = false;
+    while (g_rpc_current_tick < now_tick && !out_of_memory)
+    {
+        g_rpc_current_tick++;
+        int32_t index = g_rpc_wheel[g_rpc_current_tick & (RPC_WHEEL_SLOTS - 1)];
+        while (index != -1)
+        {
+            struct struct_rpc_request *request = &g_rpc_pool[index];
+            int32_t next = request->next;
+            if (request->expiry_tick > now_tick)
+            {
+                index = next; // due on a later turn of the wheel
+                continue;
+            }
+            if (number_of_expired == expired_capacity)
+            {
+                size_t capacity = expired_capacity ? expired_capacity * 2 : 16;
+                struct struct_rpc_completion *tmp = realloc(expired, capacity * sizeof(*tmp));
+                if (!tmp)
+                {
+                    // step back so the next call visits this slot again instead of a full turn later
+                    g_rpc_current_tick--;
+                    out_of_memory = true;
+                    break;
+                }
+                expired = tmp;
+                expired_capacity = capacity;
+            }
+            expired[number_of_expired].response_function_ptr = request->response_function_ptr;
+            expired[number_of_expired].user_data = request->user_data;
+            number_of_expired++;
+            rpc_table_remove(rpc_table_find(request->correlation_id));
+            rpc_release(index);
+            index = next;
+        }
+    }
+    pthread_mutex_unlock(&g_rpc_mutex);
+
+    for (size_t i = 0; i < number_of_expired; ++i)
+        expired[i].response_function_ptr(e_libmqttlink_request_status_timeout, NULL, 0, expired[i].user_data);
+    free(expired);
+}
+
+// Internal: Milliseconds until the next non-empty wheel slot, -1 if no request is outstanding. A slot whose
+// requests are due on a later turn only costs an early wakeup, chains are never walked so the cost does not grow
+// with the number of outstanding requests.
+static int rpc_next_timeout_ms(void)
+{
+    pthread_mutex_lock(&g_rpc_mutex);
+    if (g_rpc_outstanding == 0)
+    {
+        pthread_mutex_unlock(&g_rpc_mutex);
+        return -1;
+    }
+    uint64_t deadline_tick = g_rpc_current_tick + RPC_WHEEL_SLOTS;
+    for (uint64_t tick = g_rpc_current_tick + 1; tick < g_rpc_current_tick + RPC_WHEEL_SLOTS; ++tick)
+    {
+        if (g_rpc_wheel[tick & (RPC_WHEEL_SLOTS - 1)] != -1)
+        {
+            deadline_tick = tick;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_rpc_mutex);
+    double remaining_ms = deadline_tick * (double)RPC_TICK_MS - g_rpc_clock() * 1000.0;
+    return remaining_ms > 0 ? (int)ceil(remaining_ms) : 0;
+}
+
+// Internal: Completes the request a response belongs to. Returns true if the message was a response.
+static bool rpc_handle_response(const struct mosquitto_message *msg, const mosquitto_property *properties)
+{
+    if (g_rpc_reply_topic[0] == '\0' || strcmp(msg->topic, g_rpc_reply_topic) != 0)
+        return false;
+
+    void *correlation_data = NULL;
+    uint16_t correlation_len = 0;
+    mosquitto_property_read_binary(properties, MQTT_PROP_CORRELATION_DATA, &correlation_data, &correlation_len, false);
+    if (correlation_data == NULL || correlation_len != sizeof(uint64_t))
+    {
+        printf("%s(): Response without valid correlation data dropped.\n", __func__);
+        free(correlation_data);
+        return true;
+    }
+    uint64_t id = 0;
+    for (int i = 0; i < 8; ++i)
+        id = (id << 8) | ((unsigned char *)correlation_data)[i];
+    free(correlation_data);
+
+    struct struct_rpc_completion completion = {NULL, NULL};
+    pthread_mutex_lock(&g_rpc_mutex);
+    if (g_rpc_outstanding)
+    {
+        uint32_t bucket = rpc_table_find(id);
+        int32_t index = g_rpc_table[bucket];
+        if (index != -1)
+        {
+            completion.response_function_ptr = g_rpc_pool[index].response_function_ptr;
+            completion.user_data = g_rpc_pool[index].user_data;
+            rpc_table_remove(bucket);
+            rpc_release(index);
+        }
+    }
+    pthread_mutex_unlock(&g_rpc_mutex);
+    if (completion.response_function_ptr == NULL)
+        return true; // late response after timeout
+
+    const char *payload = NULL;
+    struct struct_codec_thread_state *state = get_codec_thread_state();
+    long payload_len = state ? codec_decode(state, msg->payload, msg->payload ? (size_t)msg->payloadlen : 0, properties, &payload) : -1;
+    if (payload_len < 0)
+        completion.response_function_ptr(e_libmqttlink_request_status_error, NULL, 0, completion.user_data);
+    else
+        completion.response_function_ptr(e_libmqttlink_request_status_ok, payload, (int)payload_len, completion.user_data);
+    return true;
+}
+
+// Internal: Fails all outstanding requests and frees the correlation table.
+static void rpc_cancel_all(void)
+{
+    struct struct_rpc_completion *cancelled = NULL;
+    size_t number_of_cancelled = 0;
+
+    pthread_mutex_lock(&g_rpc_mutex);
+    if (g_rpc_outstanding)
+        cancelled = malloc(g_rpc_outstanding * sizeof(*cancelled));
+    for (uint32_t i = 0; cancelled && i < g_rpc_table_capacity; ++i)
+    {
+        if (g_rpc_table[i] == -1)
+            continue;
+        cancelled[number_of_cancelled].response_function_ptr = g_rpc_pool[g_rpc_table[i]].response_function_ptr;
+        cancelled[number_of_cancelled].user_data = g_rpc_pool[g_rpc_table[i]].user_data;
+        number_of_cancelled++;
+    }
+    free(g_rpc_pool);
+    free(g_rpc_table);
+    g_rpc_pool = NULL;
+    g_rpc_table = NULL;
+    g_rpc_pool_capacity = 0;
+    g_rpc_table_capacity = 0;
+    g_rpc_free_head = -1;
+    g_rpc_outstanding = 0;
+    g_rpc_reply_topic[0] = '\0';
+    pthread_mutex_unlock(&g_rpc_mutex);
+
+    for (size_t i = 0; i < number_of_cancelled; ++i)
+        cancelled[i].response_function_ptr(e_libmqttlink_request_status_cancelled, NULL, 0, cancelled[i].user_data);
+    free(cancelled);
+}
+
+// Internal: Dispatch received messages to the correct callback (thread-safe)
+static void message_received_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+    (void)mosq;
+    (void)obj;
+    void (*cb)(const char *, const char *) = NULL;
+
+    // Null-terminated, decompressed payload in a reusable per-thread buffer (msg->payload may not be null-terminated)
+    const char *payload_copy = NULL;
+    struct struct_codec_thread_state *state = get_codec_thread_state();
+    long payload_len = state ? codec_decode(state, msg->payload, msg->payload ? (size_t)msg->payloadlen : 0, g_current_message_properties, &payload_copy) : -1;
+    if (payload_len < 0)
+    {
+        printf("%s(): Dropping message on topic [%s]. Payload could not be decoded.\n", __func__, msg->topic);
+        return;
+    }
+
+    // lock while searching list
+    struct struct_batch_state *full_batch = NULL;
+    pthread_mutex_lock(&g_mutex_lock);
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    uint16_t n = ptr->number_of_notification_structer;
+    for (uint16_t i = 0; i < n; i++)
+    {
+        struct struct_batch_state *batch = ptr->notification_structer_ptr[i].batch;
+        if (batch)
+        {
+            bool match = false;
+            if (mosquitto_topic_matches_sub(batch->topic, msg->topic, &match) != MOSQ_ERR_SUCCESS || !match)
+                continue;
+            if (batch_append(batch, msg->topic, payload_copy, (size_t)payload_len))
+                full_batch = batch;
+            break;
+        }
+        if (!strcmp(ptr->notification_structer_ptr[i].topic, msg->topic))
+        {
+            cb = ptr->notification_structer_ptr[i].notification_function_ptr;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_mutex_lock);
+    struct _struct_libmqttlink_trace_span *span = g_current_trace_span;
+    if (span && (cb || full_batch))
+        span->callback_entry_ns = get_monotonic_time_ns();
+    if (cb)
+        cb(payload_copy, msg->topic);
+    if (full_batch)
+        batch_deliver(full_batch);
+    if (span && (cb || full_batch))
+        span->end_ns = get_monotonic_time_ns();
+}
+
+// Internal: MQTT 5 message callback, also used on 3.1.1 links where properties is NULL
+static void message_received_v5_callback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg, const mosquitto_property *properties)
+{
+    // mosquitto calls this right after reading the packet from the socket
+    long long read_time_ns = g_trace_sample_every ? get_monotonic_time_ns() : 0;
+    long long send_time_ns = g_trace_sample_every ? trace_read_send_time(properties) : 0;
+    struct _struct_libmqttlink_trace_span span;
+    if (send_time_ns || trace_sample(e_libmqttlink_trace_kind_receive))
+    {
+        memset(&span, 0, sizeof(span));
+        span.kind = e_libmqttlink_trace_kind_receive;
+        snprintf(span.topic, sizeof(span.topic), "%s", msg->topic);
+        span.start_ns = read_time_ns;
+        span.transit_ns = send_time_ns ? get_realtime_ns() - (get_monotonic_time_ns() - read_time_ns) - send_time_ns : -1;
+        g_current_trace_span = &span;
+    }
+
+    if (!rpc_handle_response(msg, properties))
+    {
+        g_current_message_properties = properties;
+        message_received_callback(mosq, obj, msg);
+        g_current_message_properties = NULL;
+    }
+
+    if (g_current_trace_span)
+    {
+        g_current_trace_span = NULL;
+        if (span.end_ns == 0)
+            span.end_ns = get_monotonic_time_ns();
+        trace_push(&span);
+        if (span.transit_ns >= 0)
+            trace_record_transit(msg->topic, span.transit_ns);
+    }
+}
+
+// Internal: Connection callback
+static void connection_callback(struct mosquitto *mosq, void *obj, int result)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    pthread_mutex_lock(&g_state_mutex);
+    if (result == 0)
+    {
+        ptr->connection_state_flag = e_libmqttlink_connection_state_connection_true;
+        pthread_cond_broadcast(&g_state_cond);
+        pthread_mutex_unlock(&g_state_mutex);
+        printf("%s(): Connection to Mosquitto server established.\n", __func__);
+        if (ptr->ready_function_ptr)
+            ptr->ready_function_ptr();
+        return;
+    }
+    ptr->connection_state_flag = e_libmqttlink_connection_state_connection_false;
+    pthread_mutex_unlock(&g_state_mutex);
+    printf("%s(): Connection to Mosquitto server failed. Reason: [%s]\n", __func__, mosquitto_strerror(result));
+}
+
+// Internal: Refill the slot's token bucket and take one token if available. Caller holds g_coalesce_mutex.
+static bool coalesce_take_token(struct struct_coalesce_slot *slot, const struct struct_coalesce_rule *rule, double now)
+{
+    if (rule->max_rate_per_sec <= 0)
+        return true;
+    slot->tokens += (now - slot->last_refill_time) * rule->max_rate_per_sec;
+    if (slot->tokens > rule->burst)
+        slot->tokens = rule->burst;
+    slot->last_refill_time = now;
+    if (slot->tokens < 1.0)
+        return false;
+    slot->tokens -= 1.0;
+    return true;
+}
+
+// Internal: Send the slot's pending value. Caller holds g_coalesce_mutex.
+static int coalesce_send_pending(struct struct_coalesce_slot *slot, struct struct_coalesce_rule *rule, double now)
+{
+    int result = publish_payload(slot->topic, slot->pending_payload, strlen(slot->pending_payload), slot->qos, NULL);
+    if (result != MOSQ_ERR_SUCCESS)
+    {
+        printf("%s(): Message could not be sent. Topic: [%s] Reason: [%s]\n", __func__, slot->topic, mosquitto_strerror(result));
+        return -1;
+    }
+
+    char *end = NULL;
+    double value = strtod(slot->pending_payload, &end);
+    slot->last_sent_value_valid = (end != slot->pending_payload);
+    slot->last_sent_value = value;
+    slot->last_send_time = now;
+    slot->pending_flag = false;
+    slot->rate_limited_flag = false;
+    rule->stats.published++;
+    return 0;
+}
+
+// Internal: Returns true if the slot's pending value is due to be sent. Caller holds g_coalesce_mutex.
+static bool coalesce_is_due(const struct struct_coalesce_slot *slot, const struct struct_coalesce_rule *rule, double now)
+{
+    if ((now - slot->last_send_time) * 1000.0 >= rule->flush_interval_ms)
+        return true;
+    if (rule->change_delta > 0 && slot->last_sent_value_valid)
+    {
+        char *end = NULL;
+        double value = strtod(slot->pending_payload, &end);
+        if (end != slot->pending_payload && fabs(value - slot->last_sent_value) > rule->change_delta)
+            return true;
+    }
+    return false;
+}
+
+// Internal: FNV-1a hash of a topic.
+static uint32_t coalesce_topic_hash(const char *topic)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)topic; *c; ++c)
+        hash = (hash ^ *c) * 16777619u;
+    return hash;
+}
+
+// Internal: Clears the index and inserts every slot again. Caller holds g_coalesce_mutex.
+static void coalesce_index_fill(uint32_t *index, uint32_t capacity)
+{
+    memset(index, 0, capacity * sizeof(*index));
+    for (uint32_t i = 0; i < g_number_of_coalesce_slots; ++i)
+    {
+        uint32_t bucket = g_coalesce_slots[i].topic_hash & (capacity - 1);
+        while (index[bucket])
+            bucket = (bucket + 1) & (capacity - 1);
+        index[bucket] = i + 1;
+    }
+}
+
+// Internal: Returns the slot of a topic, NULL if the topic was not seen yet. Caller holds g_coalesce_mutex.
+static struct struct_coalesce_slot *coalesce_find_slot(const char *topic, uint32_t hash)
+{
+    if (g_coalesce_index_capacity == 0)
+        return NULL;
+    uint32_t mask = g_coalesce_index_capacity - 1;
+    for (uint32_t bucket = hash & mask; g_coalesce_index[bucket]; bucket = (bucket + 1) & mask)
+    {
+        struct struct_coalesce_slot *slot = &g_coalesce_slots[g_coalesce_index[bucket] - 1];
+        if (slot->topic_hash == hash && !strcmp(slot->topic, topic))
+            return slot;
+    }
+    return NULL;
+}
+
+// Internal: Drops the cached misses, e.g. after a rule was added. Caller holds g_coalesce_mutex.
+static void coalesce_forget_unmatched(void)
+{
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < g_number_of_coalesce_slots; ++i)
+    {
+        if (g_coalesce_slots[i].rule_index == COALESCE_NO_RULE)
+        {
+            free(g_coalesce_slots[i].topic);
+            free(g_coalesce_slots[i].pending_payload);
+            continue;
+        }
+        g_coalesce_slots[kept++] = g_coalesce_slots[i];
+    }
+    g_number_of_coalesce_slots = kept;
+    g_number_of_unmatched_coalesce_slots = 0;
+    if (g_coalesce_index_capacity)
+        coalesce_index_fill(g_coalesce_index, g_coalesce_index_capacity);
+}
+
+// Internal: Adds a slot for a topic. Returns NULL if the table is full or out of memory. Caller holds g_coalesce_mutex.
+static struct struct_coalesce_slot *coalesce_add_slot(const char *topic, uint32_t hash, uint32_t rule_index)
+{
+    if (g_number_of_coalesce_slots >= COALESCE_MAX_SLOTS && g_number_of_unmatched_coalesce_slots >= COALESCE_MAX_SLOTS / 4)
+        coalesce_forget_unmatched();
+    if (g_number_of_coalesce_slots >= COALESCE_MAX_SLOTS)
+    {
+        static bool warned = false;
+        if (!warned)
+            printf("%s(): Coalescing table is full, new topics are published without coalescing.\n", __func__);
+        warned = true;
+        return NULL;
+    }
+
+    if ((g_number_of_coalesce_slots + 1) * 2 > g_coalesce_index_capacity)
+    {
+        uint32_t capacity = g_coalesce_index_capacity ? g_coalesce_index_capacity * 2 : 64;
+        uint32_t *index = malloc(capacity * sizeof(*index));
+        if (!index)
+        {
+            printf("%s(): malloc() failed.\n", __func__);
+            return NULL;
+        }
+        coalesce_index_fill(index, capacity);
+        free(g_coalesce_index);
+        g_coalesce_index = index;
+        g_coalesce_index_capacity = capacity;
+    }
+    if (g_number_of_coalesce_slots == g_coalesce_slots_capacity)
+    {
+        uint32_t capacity = g_coalesce_slots_capacity ? g_coalesce_slots_capacity * 2 : 32;
+        struct struct_coalesce_slot *tmp = realloc(g_coalesce_slots, capacity * sizeof(*tmp));
+        if (!tmp)
+        {
+            printf("%s(): realloc() failed.\n", __func__);
+            return NULL;
+        }
+        g_coalesce_slots = tmp;
+        g_coalesce_slots_capacity = capacity;
+    }
+
+    struct struct_coalesce_slot *slot = &g_coalesce_slots[g_number_of_coalesce_slots];
+    memset(slot, 0, sizeof(*slot));
+    slot->topic = strdup_safe(topic);
+    if (!slot->topic)
+        return NULL;
+    slot->topic_hash = hash;
+    slot->rule_index = rule_index;
+    if (rule_index != COALESCE_NO_RULE)
+    {
+        slot->tokens = g_coalesce_rules[rule_index].burst;
+        slot->last_refill_time = get_monotonic_time();
+        slot->last_send_time = -1e9; // first value goes out immediately
+    }
+    else
+        g_number_of_unmatched_coalesce_slots++;
+
+    uint32_t mask = g_coalesce_index_capacity - 1;
+    uint32_t bucket = hash & mask;
+    while (g_coalesce_index[bucket])
+        bucket = (bucket + 1) & mask;
+    g_coalesce_index[bucket] = ++g_number_of_coalesce_slots;
+    return slot;
+}
+
+// Internal: Hold back a publish on a coalesced topic. Returns 1 if the topic is not coalesced, 0 on success, -1 on error.
+static int coalesce_publish(const char *topic, const char *message_contents, int qos)
+{
+    if (!atomic_load_explicit(&g_coalesce_enabled, memory_order_relaxed))
+        return 1;
+
+    uint32_t hash = coalesce_topic_hash(topic);
+    pthread_mutex_lock(&g_coalesce_mutex);
+    struct struct_coalesce_slot *slot = coalesce_find_slot(topic, hash);
+    if (slot == NULL)
+    {
+        // rules are only matched on the first publish of a topic, misses are cached as well
+        uint32_t rule_index = COALESCE_NO_RULE;
+        for (uint16_t i = 0; i < g_number_of_coalesce_rules; ++i)
+        {
+            bool match = false;
+            if (mosquitto_topic_matches_sub(g_coalesce_rules[i].topic_pattern, topic, &match) == MOSQ_ERR_SUCCESS && match)
+            {
+                rule_index = i;
+                break;
+            }
+        }
+        slot = coalesce_add_slot(topic, hash, rule_index);
+    }
+    if (slot == NULL || slot->rule_index == COALESCE_NO_RULE)
+    {
+        pthread_mutex_unlock(&g_coalesce_mutex);
+        return 1;
+    }
+
+    struct struct_coalesce_rule *rule = &g_coalesce_rules[slot->rule_index];
+    size_t len = strlen(message_contents) + 1;
+    if (len > slot->pending_capacity)
+    {
+        char *tmp = realloc(slot->pending_payload, len);
+        if (!tmp)
+        {
+            printf("%s(): realloc() failed.\n", __func__);
+            pthread_mutex_unlock(&g_coalesce_mutex);
+            return -1;
+        }
+        slot->pending_payload = tmp;
+        slot->pending_capacity = len;
+    }
+
+    rule->stats.updates++;
+    if (slot->pending_flag)
+        rule->stats.suppressed++; // previous value never reached the socket
+    memcpy(slot->pending_payload, message_contents, len);
+    slot->pending_flag = true;
+    slot->rate_limited_flag = false;
+    slot->qos = qos;
+
+    int rc = 0;
+    double now = get_monotonic_time();
+    if (coalesce_is_due(slot, rule, now))
+    {
+        if (coalesce_take_token(slot, rule, now))
+            rc = coalesce_send_pending(slot, rule, now);
+        else
+        {
+            rule->stats.rate_limited++;
+            slot->rate_limited_flag = true;
+        }
+    }
+    pthread_mutex_unlock(&g_coalesce_mutex);
+    return rc;
+}
+
+// Internal: Flush coalesced values that became due. A final flush sends every pending value regardless of
+// the interval and token bucket. Called from the connection thread.
+static void coalesce_flush(bool final_flush)
+{
+    if (libmqttlink_get_connection_state() == e_libmqttlink_connection_state_connection_false)
+        return; // keep pending values until the link is back
+
+    pthread_mutex_lock(&g_coalesce_mutex);
+    double now = get_monotonic_time();
+    for (uint32_t i = 0; i < g_number_of_coalesce_slots; ++i)
+    {
+        struct struct_coalesce_slot *slot = &g_coalesce_slots[i];
+        if (!slot->pending_flag)
+            continue;
+        struct struct_coalesce_rule *rule = &g_coalesce_rules[slot->rule_index];
+        if (!final_flush && !coalesce_is_due(slot, rule, now))
+            continue;
+        if (final_flush || coalesce_take_token(slot, rule, now))
+        {
+            // deferred sends are sampled on their own, the publish call that stored the value already returned
+            bool traced = trace_sample(e_libmqttlink_trace_kind_publish);
+            long long start_ns = traced ? get_monotonic_time_ns() : 0;
+            g_trace_stamp_publish = traced;
+            int rc = coalesce_send_pending(slot, rule, now);
+            g_trace_stamp_publish = false;
+            if (traced && rc == 0)
+                trace_push_publish(slot->topic, start_ns);
+        }
+        else if (!slot->rate_limited_flag)
+        {
+            rule->stats.rate_limited++;
+            slot->rate_limited_flag = true;
+        }
+    }
+    pthread_mutex_unlock(&g_coalesce_mutex);
+}
+
+// Internal: mosquitto_loop() timeout short enough to honour the tightest flush interval, batch linger time and request timeout.
+static int get_loop_timeout_ms(int default_timeout_ms)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    int timeout = default_timeout_ms;
+    double now = get_monotonic_time();
+    pthread_mutex_lock(&g_mutex_lock);
+    for (uint16_t i = 0; i < ptr->number_of_notification_structer; ++i)
+    {
+        // only batches holding messages have a deadline, a new message wakes mosquitto_loop() anyway
+        struct struct_batch_state *batch = ptr->notification_structer_ptr[i].batch;
+        if (!batch || !batch->linger_ms || !batch->count)
+            continue;
+        double remaining_ms = batch->linger_ms - (now - batch->first_message_time) * 1000.0;
+        if (remaining_ms < timeout)
+            timeout = remaining_ms > 0 ? (int)ceil(remaining_ms) : 0;
+    }
+    pthread_mutex_unlock(&g_mutex_lock);
+
+    int rpc_timeout = rpc_next_timeout_ms();
+    if (rpc_timeout >= 0 && rpc_timeout < timeout)
+        timeout = rpc_timeout;
+
+    pthread_mutex_lock(&g_coalesce_mutex);
+    for (uint16_t i = 0; i < g_number_of_coalesce_rules; ++i)
+    {
+        int interval = (int)g_coalesce_rules[i].flush_interval_ms;
+        if (g_coalesce_rules[i].max_rate_per_sec > 0)
+        {
+            int rate_interval = (int)(1000.0 / g_coalesce_rules[i].max_rate_per_sec);
+            if (rate_interval < interval || interval == 0)
+                interval = rate_interval;
+        }
+        if (interval < timeout)
+            timeout = interval;
+    }
+    pthread_mutex_unlock(&g_coalesce_mutex);
+    return timeout > 10 ? timeout : 10;
+}
+
+// Internal: Sleeps on the connection thread in steps, coalesced values, lingering batches and request timeouts
+// are still served.
+static void connection_thread_sleep(unsigned int milisec)
+{
+    double deadline = get_monotonic_time() + milisec / 1000.0;
+    while (!g_stop_flag)
+    {
+        coalesce_flush(false);
+        batch_flush(false);
+        rpc_expire_due();
+        double remaining_ms = (deadline - get_monotonic_time()) * 1000.0;
+        if (remaining_ms <= 0)
+            break;
+        int step_ms = get_loop_timeout_ms(1000);
+        sleep_milisec(remaining_ms < step_ms ? (unsigned int)ceil(remaining_ms) : (unsigned int)step_ms);
+    }
+}
+
+// Internal: Subscribe to all registered topics
+static int subscribe_all_topics(void)
+{
+    uint16_t subs_counter = 0;
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    const int MAX_ATTEMPTS = 10;
+    int attempts = 0;
+
+    // shared response topic for libmqttlink_request()
+    if (g_rpc_reply_topic[0] != '\0')
+    {
+        int result = mosquitto_subscribe(ptr->mosquitto_structer_ptr, NULL, g_rpc_reply_topic, 1);
+        if (result != MOSQ_ERR_SUCCESS)
+            printf("%s(): Could not subscribe to response topic [%s]. Reason: [%s]\n", __func__, g_rpc_reply_topic, mosquitto_strerror(result));
+    }
+
+    while (attempts < MAX_ATTEMPTS)
+    {
+        subs_counter = 0;
+        pthread_mutex_lock(&g_mutex_lock);
+        for (uint16_t i = 0; i < ptr->number_of_notification_structer; ++i)
+        {
+            int *mid = NULL;
+            int qos = ptr->notification_structer_ptr[i].qos;
+            int result = mosquitto_subscribe(ptr->mosquitto_structer_ptr, mid, ptr->notification_structer_ptr[i].topic, qos);
+            if (result != MOSQ_ERR_SUCCESS)
+            {
+                printf("%s(): Could not subscribe to topic [%s]. Reason: [%s]\n", __func__, ptr->notification_structer_ptr[i].topic, mosquitto_strerror(result));
+            }
+            else
+            {
+                printf("%s(): Subscribed to topic [%s].\n", __func__, ptr->notification_structer_ptr[i].topic);
+                subs_counter++;
+            }
+        }
+        pthread_mutex_unlock(&g_mutex_lock);
+        if (subs_counter == ptr->number_of_notification_structer)
+            return 0;
+        attempts++;
+        connection_thread_sleep(500 + attempts * 200);
+    }
+    printf("%s(): Failed to subscribe all topics after %d attempts.\n", __func__, MAX_ATTEMPTS);
+    return -1;
+}
+
+// Internal: Unsubscribe from all topics
+static int unsubscribe_all_topics(void)
+{
+    uint16_t unsubs_counter = 0;
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    const int MAX_ATTEMPTS = 10;
+    int attempts = 0;
+    while (attempts < MAX_ATTEMPTS)
+    {
+        unsubs_counter = 0;
+        pthread_mutex_lock(&g_mutex_lock);
+        for (uint16_t i = 0; i < ptr->number_of_notification_structer; ++i)
+        {
+            int *mid = NULL;
+            int result = mosquitto_unsubscribe(ptr->mosquitto_structer_ptr, mid, ptr->notification_structer_ptr[i].topic);
+            if (result != MOSQ_ERR_SUCCESS)
+            {
+                printf("%s(): Could not unsubscribe from topic [%s]. Reason: [%s]\n", __func__, ptr->notification_structer_ptr[i].topic, mosquitto_strerror(result));
+            }
+            else
+            {
+                printf("%s(): Unsubscribed from topic [%s].\n", __func__, ptr->notification_structer_ptr[i].topic);
+                unsubs_counter++;
+            }
+        }
+        pthread_mutex_unlock(&g_mutex_lock);
+        if (unsubs_counter == ptr->number_of_notification_structer)
+            return 0;
+        attempts++;
+        connection_thread_sleep(300 + attempts * 150);
+    }
+    printf("%s(): Failed to unsubscribe all topics after %d attempts.\n", __func__, MAX_ATTEMPTS);
+    return -1;
+}
+
+// Internal: Creates a library thread with the placement configured for its role.
+// Falls back to default scheduling if the real-time priority is not permitted.
+static int create_library_thread(enum _enum_libmqttlink_thread_role role, pthread_t *thread_id, void *(*start_routine)(void *), void *arg)
+{
+    const struct struct_thread_config *config = &g_thread_config[role];
+    pthread_attr_t attr;
+    int result = pthread_attr_init(&attr);
+    if (result)
+        return result;
+
+    if (config->stack_size)
+    {
+        result = pthread_attr_setstacksize(&attr, config->stack_size);
+        if (result)
+            printf("%s(): Stack size [%zu] not applied. Reason: [%s]\n", __func__, config->stack_size, strerror(result));
+    }
+
+#ifdef OS_Linux
+    if (config->number_of_cpus)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (unsigned int i = 0; i < config->number_of_cpus; ++i)
+            CPU_SET(config->cpus[i], &cpu_set);
+        result = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+        if (result)
+            printf("%s(): CPU affinity not applied. Reason: [%s]\n", __func__, strerror(result));
+    }
+#endif
+
+    if (config->sched_fifo_priority > 0)
+    {
+        struct sched_param param = {.sched_priority = config->sched_fifo_priority};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    result = pthread_create(thread_id, &attr, start_routine, arg);
+    if (result == EPERM && config->sched_fifo_priority > 0)
+    {
+        printf("%s(): SCHED_FIFO priority [%d] not permitted, using default scheduling.\n", __func__, config->sched_fifo_priority);
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        result = pthread_create(thread_id, &attr, start_routine, arg);
+    }
+    pthread_attr_destroy(&attr);
+
+#ifdef OS_Linux
+    if (result == 0 && config->name[0] != '\0')
+        pthread_setname_np(*thread_id, config->name);
+#endif
+    return result;
+}
+
+#ifdef MQTTLINK_OPENSSL
+// Internal: Keeps the newest session from the broker for resumption on the next connect.
+static int tls_new_session_callback(SSL *ssl, SSL_SESSION *session)
+{
+    (void)ssl;
+    pthread_mutex_lock(&g_tls_mutex);
+    if (g_tls_session)
+        SSL_SESSION_free(g_tls_session);
+    g_tls_session = session; // reference handed over by returning 1
+    pthread_mutex_unlock(&g_tls_mutex);
+    return 1;
+}
+
+// Internal: Offers the cached session before the ClientHello is built and times the handshake.
+static void tls_info_callback(const SSL *ssl, int where, int ret)
+{
+    (void)ret;
+    if ((where & SSL_CB_HANDSHAKE_START) && SSL_in_before(ssl))
+    {
+        pthread_mutex_lock(&g_tls_mutex);
+        if (g_tls_session && g_libmqttlink_struct.tls_session_resumption)
+            SSL_set_session((SSL *)ssl, g_tls_session);
+        g_tls_handshake_start_time = get_monotonic_time();
+        g_tls_handshake_in_progress = true;
+        pthread_mutex_unlock(&g_tls_mutex);
+    }
+    else if (where & SSL_CB_HANDSHAKE_DONE)
+    {
+        pthread_mutex_lock(&g_tls_mutex);
+        if (g_tls_handshake_in_progress)
+        {
+            double elapsed_ms = (get_monotonic_time() - g_tls_handshake_start_time) * 1000.0;
+            g_tls_stats.handshakes++;
+            if (SSL_session_reused((SSL *)ssl))
+                g_tls_stats.resumed++;
+            g_tls_stats.last_handshake_ms = elapsed_ms;
+            g_tls_stats.total_handshake_ms += elapsed_ms;
+            g_tls_handshake_in_progress = false;
+        }
+        pthread_mutex_unlock(&g_tls_mutex);
+    }
+}
+
+// Internal: Builds the shared SSL_CTX once. mosquitto still loads CA, certificate and key into it.
+static SSL_CTX *get_shared_ssl_ctx(void)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (g_ssl_ctx)
+        return g_ssl_ctx;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
+        return NULL;
+    if (ptr->tls_ciphers && SSL_CTX_set_cipher_list(ctx, ptr->tls_ciphers) != 1)
+        printf("%s(): Cipher list [%s] not applied.\n", __func__, ptr->tls_ciphers);
+    if (ptr->tls_ciphersuites && SSL_CTX_set_ciphersuites(ctx, ptr->tls_ciphersuites) != 1)
+        printf("%s(): TLS 1.3 cipher suites [%s] not applied.\n", __func__, ptr->tls_ciphersuites);
+    if (ptr->tls_groups && SSL_CTX_set1_groups_list(ctx, ptr->tls_groups) != 1)
+        printf("%s(): Groups [%s] not applied.\n", __func__, ptr->tls_groups);
+    if (ptr->tls_session_resumption)
+    {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, tls_new_session_callback);
+    }
+    SSL_CTX_set_info_callback(ctx, tls_info_callback);
+    g_ssl_ctx = ctx;
+    return g_ssl_ctx;
+}
+#endif
+
+// Internal: Opens non-blocking TCP connections to all pre-resolved addresses at once and returns
+// the index of the first one that completes, -1 if none does within timeout_ms.
+static int probe_addresses(char *const *addresses, unsigned int number_of_addresses, int port, unsigned int timeout_ms)
+{
+    struct pollfd fds[16];
+    unsigned int n = number_of_addresses < 16 ? number_of_addresses : 16;
+    int index_of_fd[16];
+    unsigned int number_of_fds = 0;
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        struct addrinfo hints = {0}, *res = NULL;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV; // no DNS on this path
+        if (getaddrinfo(addresses[i], port_str, &hints, &res) != 0)
+        {
+            printf("%s(): Skipping address [%s]. Not a numeric address.\n", __func__, addresses[i]);
+            continue;
+        }
+        int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && (connect(fd, res->ai_addr, res->ai_addrlen) == 0 || errno == EINPROGRESS))
+        {
+            fds[number_of_fds].fd = fd;
+            fds[number_of_fds].events = POLLOUT;
+            index_of_fd[number_of_fds] = (int)i;
+            number_of_fds++;
+        }
+        else if (fd >= 0)
+        {
+            close(fd);
+        }
+        freeaddrinfo(res);
+    }
+
+    int winner = -1;
+    double deadline = get_monotonic_time() + timeout_ms / 1000.0;
+    unsigned int pending = number_of_fds;
+    while (winner == -1 && pending > 0)
+    {
+        int remaining_ms = (int)((deadline - get_monotonic_time()) * 1000.0);
+        if (remaining_ms <= 0 || poll(fds, number_of_fds, remaining_ms) <= 0)
+            break;
+        for (unsigned int i = 0; i < number_of_fds && winner == -1; ++i)
+        {
+            if (fds[i].fd < 0 || fds[i].revents == 0)
+                continue;
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len) == 0 && so_error == 0)
+            {
+                winner = index_of_fd[i];
+            }
+            else
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1; // poll() ignores negative descriptors
+                pending--;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < number_of_fds; ++i)
+    {
+        if (fds[i].fd >= 0)
+            close(fds[i].fd);
+    }
+    return winner;
+}
+
+// Internal: Starts a connection attempt, in the background if async connect is enabled.
+// Pre-resolved addresses are only probed when probe is set (first connect, or after an attempt on
+// the previous winner failed); other reconnects go straight back to the last host.
+static int start_connect(bool reconnect, bool probe)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    const int keepalive = 60;
+    const char *host = ptr->server_ip_address;
+
+    if (ptr->number_of_connect_addresses && (probe || !reconnect))
+    {
+        unsigned int timeout_ms = ptr->connect_timeout_ms ? ptr->connect_timeout_ms : 1000;
+        int winner = probe_addresses(ptr->connect_addresses, ptr->number_of_connect_addresses, ptr->server_port, timeout_ms);
+        if (winner >= 0)
+            host = ptr->connect_addresses[winner];
+        else
+            printf("%s(): No pre-resolved address answered, using [%s].\n", __func__, host);
+        reconnect = false; // host may have changed
+    }
+
+    if (ptr->connect_async)
+        return reconnect ? mosquitto_reconnect_async(ptr->mosquitto_structer_ptr) : mosquitto_connect_async(ptr->mosquitto_structer_ptr, host, ptr->server_port, keepalive);
+    return reconnect ? mosquitto_reconnect(ptr->mosquitto_structer_ptr) : mosquitto_connect(ptr->mosquitto_structer_ptr, host, ptr->server_port, keepalive);
+}
+
+// Internal: Thread function to manage connection and periodic restart
+static void *connection_state_thread(void *login_info_ptr)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    mosquitto_lib_init();
+
+    bool clean_session = false;
+    void *obj = NULL;
+    ptr->mosquitto_structer_ptr = mosquitto_new(get_client_id(), clean_session, obj);
+    if (ptr->mosquitto_structer_ptr == NULL)
+    {
+        printf("%s(): Failed to start Mosquitto library. Memory error.\n", __func__);
+        mosquitto_lib_cleanup();
+        pthread_exit(NULL);
+    }
+
+    if (ptr->protocol_version == 5)
+    {
+        mosquitto_int_option(ptr->mosquitto_structer_ptr, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        pthread_mutex_lock(&g_rpc_mutex);
+        snprintf(g_rpc_reply_topic, sizeof(g_rpc_reply_topic), "libmqttlink/rpc/%s/reply", get_client_id());
+        for (int i = 0; i < RPC_WHEEL_SLOTS; ++i)
+            g_rpc_wheel[i] = -1;
+        g_rpc_current_tick = rpc_tick_now();
+        g_rpc_next_correlation_id = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+        pthread_mutex_unlock(&g_rpc_mutex);
+    }
+
+    // Apply Will if configured
+    if (ptr->will_topic && ptr->will_payload)
+    {
+        int rc = mosquitto_will_set(ptr->mosquitto_structer_ptr, ptr->will_topic, (int)strlen(ptr->will_payload), ptr->will_payload, ptr->will_qos, ptr->will_retain);
+        if (rc != MOSQ_ERR_SUCCESS)
+            printf("%s(): Failed to set will: %s\n", __func__, mosquitto_strerror(rc));
+    }
+
+    // Apply TLS if configured
+    if (ptr->tls_cafile || ptr->tls_capath || ptr->tls_certfile || ptr->tls_keyfile)
+    {
+        int rc = mosquitto_tls_set(ptr->mosquitto_structer_ptr, ptr->tls_cafile, ptr->tls_capath, ptr->tls_certfile, ptr->tls_keyfile, NULL);
+        if (rc != MOSQ_ERR_SUCCESS)
+            printf("%s(): Failed to set TLS: %s\n", __func__, mosquitto_strerror(rc));
+        if (ptr->tls_insecure)
+            mosquitto_tls_insecure_set(ptr->mosquitto_structer_ptr, true);
+        if (ptr->tls_version)
+        {
+            rc = mosquitto_tls_opts_set(ptr->mosquitto_structer_ptr, 1, ptr->tls_version, NULL);
+            if (rc != MOSQ_ERR_SUCCESS)
+                printf("%s(): Failed to set TLS opts: %s\n", __func__, mosquitto_strerror(rc));
+        }
+#ifdef MQTTLINK_OPENSSL
+        // Shared context: keeps the session cache and cipher settings across reconnects
+        if (ptr->tls_session_resumption || ptr->tls_ciphers || ptr->tls_ciphersuites || ptr->tls_groups)
+        {
+            SSL_CTX *ctx = get_shared_ssl_ctx();
+            if (ctx)
+            {
+                mosquitto_void_option(ptr->mosquitto_structer_ptr, MOSQ_OPT_SSL_CTX, ctx);
+                mosquitto_int_option(ptr->mosquitto_structer_ptr, MOSQ_OPT_SSL_CTX_WITH_DEFAULTS, 1);
+            }
+            else
+            {
+                printf("%s(): Failed to create SSL context, using mosquitto defaults.\n", __func__);
+            }
+        }
+#endif
+    }
 
     mosquitto_username_pw_set(ptr->mosquitto_structer_ptr, ptr->user_name, ptr->password);
     mosquitto_connect_callback_set(ptr->mosquitto_structer_ptr, connection_callback);
-    mosquitto_message_callback_set(ptr->mosquitto_structer_ptr, message_received_callback);
+    mosquitto_message_v5_callback_set(ptr->mosquitto_structer_ptr, message_received_v5_callback);
 
-    int keepalive = 60;
-    int initial_connect_rc = mosquitto_connect(ptr->mosquitto_structer_ptr, ptr->server_ip_address, ptr->server_port, keepalive);
+    double connect_start_time = get_monotonic_time();
+    int initial_connect_rc = start_connect(false, true);
     if (initial_connect_rc != MOSQ_ERR_SUCCESS)
         printf("%s(): Initial connect failed: %s\n", __func__, mosquitto_strerror(initial_connect_rc));
 
     int max_packets = 1;
     int timeout = 1000;
-    double last_restart_time = 0;
+    double last_restart_time = get_system_time();
     volatile bool restart_flag = 0;
 
-    // Reconnect backoff
-    int backoff_ms = 500; // start
+    // Reconnect backoff, the first retry is immediate
+    int backoff_ms = 0;
     const int max_backoff_ms = 30000;
+    double reconnect_time = 0; // next reconnect attempt while the link is down, 0 otherwise
+    bool link_up_since_attempt = false; // false if the last connect attempt never came up
 
     while (!g_stop_flag)
     {
-        int result = mosquitto_loop(ptr->mosquitto_structer_ptr, timeout, max_packets);
+        if (reconnect_time > 0)
+        {
+            // Link is down: batches and request timeouts are still served while waiting for the next attempt
+            double wait_ms = (reconnect_time - get_monotonic_time()) * 1000.0;
+            if (wait_ms > 0)
+                connection_thread_sleep((unsigned int)ceil(wait_ms));
+            if (g_stop_flag)
+                break;
+            reconnect_time = 0;
+            connect_start_time = get_monotonic_time();
+            start_connect(true, !link_up_since_attempt);
+            link_up_since_attempt = false;
+            subsc_fonk_check_flag = 0; // restore subscriptions once connected
+            continue;
+        }
+
+        int result = mosquitto_loop(ptr->mosquitto_structer_ptr, get_loop_timeout_ms(timeout), max_packets);
+        bool connected = (libmqttlink_get_connection_state() == e_libmqttlink_connection_state_connection_true);
+
+        // async connect still pending after the configured timeout
+        if (result == MOSQ_ERR_SUCCESS && !connected && ptr->connect_async && ptr->connect_timeout_ms &&
+            (get_monotonic_time() - connect_start_time) * 1000.0 > ptr->connect_timeout_ms)
+        {
+            printf("%s(): Connect timed out after [%u] ms.\n", __func__, ptr->connect_timeout_ms);
+            mosquitto_disconnect(ptr->mosquitto_structer_ptr);
+            result = MOSQ_ERR_NO_CONN;
+        }
+
         if (result != MOSQ_ERR_SUCCESS)
         {
             pthread_mutex_lock(&g_state_mutex);
             ptr->connection_state_flag = e_libmqttlink_connection_state_connection_false;
             pthread_mutex_unlock(&g_state_mutex);
             printf("%s(): mosquitto_loop(): Connection lost. Reason: [%s]\n", __func__, mosquitto_strerror(result));
-            sleep_milisec(backoff_ms);
-            mosquitto_reconnect(ptr->mosquitto_structer_ptr);
+            connected = false;
+            reconnect_time = get_monotonic_time() + backoff_ms / 1000.0;
             // exponential backoff with cap
-            backoff_ms *= 2;
+            backoff_ms = backoff_ms ? backoff_ms * 2 : 500;
             if (backoff_ms > max_backoff_ms)
                 backoff_ms = max_backoff_ms;
-            continue; // skip rest of loop until success
         }
-        else
+        else if (connected)
         {
             // reset backoff on success
-            backoff_ms = 500;
+            backoff_ms = 0;
+            link_up_since_attempt = true;
         }
 
-        if (result == MOSQ_ERR_SUCCESS && subsc_fonk_check_flag == 0)
+        if (connected && subsc_fonk_check_flag == 0)
         {
             subscribe_all_topics();
             subsc_fonk_check_flag = 1;
         }
 
-        if (result == MOSQ_ERR_SUCCESS && restart_flag == 1)
+        if (connected && restart_flag == 1)
         {
             subscribe_all_topics();
             restart_flag = 0;
         }
 
+        coalesce_flush(false);
+        batch_flush(false);
+        rpc_expire_due();
+
         double now = get_system_time();
         const int h24_sec = 86400;
-        if ((now - last_restart_time) > h24_sec)
+        if (reconnect_time == 0 && (now - last_restart_time) > h24_sec)
         {
             printf("%s(): mosquitto_loop(): Restarting broker connection!\n", __func__);
             last_restart_time = now;
             unsubscribe_all_topics();
-            sleep_milisec(1000);
-            mosquitto_reconnect(ptr->mosquitto_structer_ptr);
-            sleep_milisec(1000);
+            connection_thread_sleep(1000);
+            connect_start_time = get_monotonic_time();
+            start_connect(true, false);
+            connection_thread_sleep(1000);
             restart_flag = 1;
         }
 
-        sleep_milisec(10);
+        // mosquitto_loop() already waits for traffic while the link is up and reads one packet per call,
+        // a fixed sleep there would cap reception at about 100 messages per second
+        if (!connected)
+            sleep_milisec(10);
+    }
+
+    // Values held back by coalescing are the latest state of their topics, hand them over before disconnecting
+    if (libmqttlink_get_connection_state() == e_libmqttlink_connection_state_connection_true)
+    {
+        coalesce_flush(true);
+        for (int i = 0; i < 100 && mosquitto_want_write(ptr->mosquitto_structer_ptr); ++i)
+        {
+            if (mosquitto_loop(ptr->mosquitto_structer_ptr, 10, 1) != MOSQ_ERR_SUCCESS)
+                break;
+        }
     }
+    // Received messages still waiting in batches are delivered before the subscriptions are freed
+    batch_flush(true);
     pthread_exit(NULL);
 }
 
@@ -421,9 +2207,10 @@ int libmqttlink_connect_and_monitor(const char *server_ip_address, int server_po
         pthread_mutex_destroy(&g_mutex_lock);
         return -1;
     }
+    pthread_once(&g_state_cond_once, state_cond_init);
     g_stop_flag = false;
 
-    int result = pthread_create(&ptr->link_control_thread_id, NULL, connection_state_thread, NULL);
+    int result = create_library_thread(e_libmqttlink_thread_role_network, &ptr->link_control_thread_id, connection_state_thread, NULL);
     if (result)
     {
         printf("%s(): Thread could not be created. Reason: [%s]\n", __func__, strerror(result));
@@ -444,6 +2231,7 @@ void libmqttlink_shutdown(void)
         printf("%s(): Signaling connection control thread to stop.\n", __func__);
         g_stop_flag = true; // graceful stop
         pthread_join(ptr->link_control_thread_id, NULL);
+        ptr->link_control_thread_id = 0;
 
         printf("%s(): Disconnecting from Mosquitto server.\n", __func__);
         if (ptr->connection_state_flag == e_libmqttlink_connection_state_connection_true)
@@ -456,10 +2244,22 @@ void libmqttlink_shutdown(void)
         if (ptr->notification_structer_ptr != NULL)
         {
             printf("%s(): Freeing subscriber memory.\n", __func__);
+            for (uint16_t i = 0; i < ptr->number_of_notification_structer; ++i)
+                batch_state_free(ptr->notification_structer_ptr[i].batch);
             free(ptr->notification_structer_ptr);
         }
+        while (g_retired_batches)
+        {
+            struct struct_batch_state *next = g_retired_batches->next_retired;
+            batch_state_free(g_retired_batches);
+            g_retired_batches = next;
+        }
+        free(g_due_batches);
+        g_due_batches = NULL;
+        g_due_batches_capacity = 0;
 
         ptr->notification_structer_ptr = NULL;
+        ptr->number_of_notification_structer = 0;
         ptr->mosquitto_structer_ptr = NULL;
         ptr->connection_state_flag = e_libmqttlink_connection_state_connection_false;
     }
@@ -474,6 +2274,70 @@ void libmqttlink_shutdown(void)
     if (ptr->tls_certfile) { free((void*)ptr->tls_certfile); ptr->tls_certfile = NULL; }
     if (ptr->tls_keyfile) { free((void*)ptr->tls_keyfile); ptr->tls_keyfile = NULL; }
     if (ptr->tls_version) { free((void*)ptr->tls_version); ptr->tls_version = NULL; }
+    if (ptr->tls_ciphers) { free((void*)ptr->tls_ciphers); ptr->tls_ciphers = NULL; }
+    if (ptr->tls_ciphersuites) { free((void*)ptr->tls_ciphersuites); ptr->tls_ciphersuites = NULL; }
+    if (ptr->tls_groups) { free((void*)ptr->tls_groups); ptr->tls_groups = NULL; }
+    ptr->tls_session_resumption = 0;
+#ifdef MQTTLINK_OPENSSL
+    pthread_mutex_lock(&g_tls_mutex);
+    if (g_tls_session) { SSL_SESSION_free(g_tls_session); g_tls_session = NULL; }
+    if (g_ssl_ctx) { SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL; }
+    memset(&g_tls_stats, 0, sizeof(g_tls_stats));
+    pthread_mutex_unlock(&g_tls_mutex);
+#endif
+
+    for (unsigned int i = 0; i < ptr->number_of_connect_addresses; ++i)
+        free(ptr->connect_addresses[i]);
+    free(ptr->connect_addresses);
+    ptr->connect_addresses = NULL;
+    ptr->number_of_connect_addresses = 0;
+
+    rpc_cancel_all();
+    ptr->protocol_version = 4;
+
+    g_trace_sample_every = 0;
+    free(g_trace_ring);
+    g_trace_ring = NULL;
+    g_trace_ring_size = 0;
+    atomic_store(&g_trace_head, 0);
+    pthread_mutex_lock(&g_trace_mutex);
+    free(g_trace_topics);
+    g_trace_topics = NULL;
+    g_number_of_trace_topics = 0;
+    pthread_mutex_unlock(&g_trace_mutex);
+
+    if (ptr->codec_dictionary) { free(ptr->codec_dictionary); ptr->codec_dictionary = NULL; }
+    ptr->codec_dictionary_size = 0;
+    ptr->codec = e_libmqttlink_codec_none;
+#ifdef MQTTLINK_ZSTD
+    ZSTD_freeCDict(g_zstd_cdict);
+    ZSTD_freeDDict(g_zstd_ddict);
+    g_zstd_cdict = NULL;
+    g_zstd_ddict = NULL;
+#endif
+#ifdef MQTTLINK_LZ4
+    if (g_lz4_dict_stream) { LZ4_freeStream(g_lz4_dict_stream); g_lz4_dict_stream = NULL; }
+#endif
+
+    pthread_mutex_lock(&g_coalesce_mutex);
+    atomic_store(&g_coalesce_enabled, false);
+    for (uint32_t i = 0; i < g_number_of_coalesce_slots; ++i)
+    {
+        free(g_coalesce_slots[i].topic);
+        free(g_coalesce_slots[i].pending_payload);
+    }
+    free(g_coalesce_slots);
+    free(g_coalesce_index);
+    free(g_coalesce_rules);
+    g_coalesce_slots = NULL;
+    g_coalesce_index = NULL;
+    g_coalesce_rules = NULL;
+    g_number_of_coalesce_slots = 0;
+    g_number_of_unmatched_coalesce_slots = 0;
+    g_coalesce_slots_capacity = 0;
+    g_coalesce_index_capacity = 0;
+    g_number_of_coalesce_rules = 0;
+    pthread_mutex_unlock(&g_coalesce_mutex);
 
     pthread_mutex_destroy(&g_mutex_lock);
     pthread_mutex_destroy(&g_state_mutex);
@@ -484,6 +2348,9 @@ void libmqttlink_shutdown(void)
  */
 int libmqttlink_publish_message(const char *topic, const char *message_contents, int qos)
 {
+    bool traced = trace_sample(e_libmqttlink_trace_kind_publish);
+    long long start_ns = traced ? get_monotonic_time_ns() : 0;
+
     struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
     pthread_mutex_lock(&g_state_mutex);
     int disconnected = (ptr->connection_state_flag == e_libmqttlink_connection_state_connection_false);
@@ -494,19 +2361,58 @@ int libmqttlink_publish_message(const char *topic, const char *message_contents,
         return -1;
     }
 
-    int *mid = NULL;
-    int message_length = strlen(message_contents);
-    int result = mosquitto_publish(ptr->mosquitto_structer_ptr, mid, topic, message_length, message_contents, qos, 0);
-    if (result != 0)
+    g_trace_stamp_publish = traced; // also stamps a coalesced value that is sent right away
+    int result = coalesce_publish(topic, message_contents, qos);
+    bool coalesced = (result <= 0);
+    if (!coalesced)
     {
-        printf("%s(): Message could not be sent. Result: [%d]\n", __func__, result);
-        return -1;
+        result = publish_payload(topic, message_contents, strlen(message_contents), qos, NULL);
+        if (result != 0)
+        {
+            printf("%s(): Message could not be sent. Result: [%d]\n", __func__, result);
+            result = -1;
+        }
     }
+    g_trace_stamp_publish = false;
+    if (traced && result == 0)
+        trace_push_publish(topic, start_ns);
+    if (coalesced || result != 0)
+        return result;
 
     sleep_milisec(1);
     return 0;
 }
 
+// Internal: Appends a subscription to the list. Topic length already checked.
+static int add_subscription(const char *topic, int qos, void (*notification_function_ptr)(const char *message_contents, const char *topic), struct struct_batch_state *batch)
+{
+    size_t tlen = strlen(topic);
+    pthread_mutex_lock(&g_mutex_lock);
+
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    uint16_t new_count = ptr->number_of_notification_structer + 1;
+    struct struct_notification_structer *tmp = (struct struct_notification_structer *)realloc(ptr->notification_structer_ptr, new_count * sizeof(struct struct_notification_structer));
+    if (!tmp)
+    {
+        printf("%s(): realloc() failed.\n", __func__);
+        pthread_mutex_unlock(&g_mutex_lock);
+        return -1;
+    }
+    ptr->notification_structer_ptr = tmp;
+    ptr->number_of_notification_structer = new_count;
+
+    int idx = new_count - 1;
+    memcpy(ptr->notification_structer_ptr[idx].topic, topic, tlen + 1);
+    ptr->notification_structer_ptr[idx].qos = qos;
+    ptr->notification_structer_ptr[idx].notification_function_ptr = notification_function_ptr;
+    ptr->notification_structer_ptr[idx].batch = batch;
+
+    subsc_fonk_check_flag = 0; // trigger re-subscribe in loop
+
+    pthread_mutex_unlock(&g_mutex_lock);
+    return 0;
+}
+
 /**
  * Subscribes to a topic and sets a callback function for incoming messages.
  */
@@ -520,35 +2426,54 @@ int libmqttlink_subscribe_topic(const char *topic, int qos, void (*notification_
     if (qos < 0 || qos > 2)
         qos = 0; // sanitize
 
-    size_t tlen = strlen(topic);
-    if (tlen >= sizeof(((struct struct_notification_structer *)0)->topic))
+    if (strlen(topic) >= sizeof(((struct struct_notification_structer *)0)->topic))
     {
         printf("%s(): Topic too long.\n", __func__);
         return -1;
     }
+    return add_subscription(topic, qos, notification_function_ptr, NULL);
+}
 
-    pthread_mutex_lock(&g_mutex_lock);
+/**
+ * Subscribes to a topic filter and delivers matching messages in batches.
+ */
+int libmqttlink_subscribe_topic_batch(const char *topic, int qos, unsigned int max_messages, unsigned int max_bytes, unsigned int linger_ms,
+                                      void (*batch_function_ptr)(const struct _struct_libmqttlink_batch_message *messages, unsigned int count, const char *topic))
+{
+    if (batch_function_ptr == NULL || topic == NULL)
+    {
+        printf("%s(): NULL values are not allowed.\n", __func__);
+        return -1;
+    }
+    if (qos < 0 || qos > 2)
+        qos = 0; // sanitize
 
-    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
-    uint16_t new_count = ptr->number_of_notification_structer + 1;
-    struct struct_notification_structer *tmp = (struct struct_notification_structer *)realloc(ptr->notification_structer_ptr, new_count * sizeof(struct struct_notification_structer));
-    if (!tmp)
+    size_t tlen = strlen(topic);
+    if (tlen >= sizeof(((struct struct_notification_structer *)0)->topic))
     {
-        printf("%s(): realloc() failed.\n", __func__);
-        pthread_mutex_unlock(&g_mutex_lock);
+        printf("%s(): Topic too long.\n", __func__);
         return -1;
     }
-    ptr->notification_structer_ptr = tmp;
-    ptr->number_of_notification_structer = new_count;
-
-    int idx = new_count - 1;
-    memcpy(ptr->notification_structer_ptr[idx].topic, topic, tlen + 1);
-    ptr->notification_structer_ptr[idx].qos = qos;
-    ptr->notification_structer_ptr[idx].notification_function_ptr = notification_function_ptr;
 
-    subsc_fonk_check_flag = 0; // trigger re-subscribe in loop
+    struct struct_batch_state *batch = calloc(1, sizeof(*batch));
+    if (!batch)
+    {
+        printf("%s(): calloc() failed.\n", __func__);
+        return -1;
+    }
+    memcpy(batch->topic, topic, tlen + 1);
+    batch->batch_function_ptr = batch_function_ptr;
+    batch->max_messages = max_messages;
+    batch->max_bytes = max_bytes;
+    batch->linger_ms = linger_ms;
+    if (!max_messages && !max_bytes && !linger_ms)
+        batch->max_messages = 1; // no limit given, deliver each message
 
-    pthread_mutex_unlock(&g_mutex_lock);
+    if (add_subscription(topic, qos, NULL, batch) != 0)
+    {
+        batch_state_free(batch);
+        return -1;
+    }
     return 0;
 }
 
@@ -584,6 +2509,14 @@ int libmqttlink_unsubscribe_topic(const char *topic)
             printf("%s(): Failed to unsubscribe from broker: %s\n", __func__, mosquitto_strerror(rc));
     }
     
+    // pending messages are delivered and the batch freed by the connection thread
+    struct struct_batch_state *batch = ptr->notification_structer_ptr[found].batch;
+    if (batch)
+    {
+        batch->next_retired = g_retired_batches;
+        g_retired_batches = batch;
+    }
+
     // shift down
     for (int j = found; j < (int)ptr->number_of_notification_structer - 1; ++j)
         ptr->notification_structer_ptr[j] = ptr->notification_structer_ptr[j + 1];
@@ -603,6 +2536,108 @@ int libmqttlink_unsubscribe_topic(const char *topic)
     return 0;
 }
 
+/**
+ * Selects the MQTT protocol version used for the connection.
+ */
+int libmqttlink_set_protocol_version(int version)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (ptr->mosquitto_structer_ptr != NULL)
+        return -1; // set before connect
+    if (version != 4 && version != 5)
+    {
+        printf("%s(): Unsupported protocol version [%d].\n", __func__, version);
+        return -1;
+    }
+    ptr->protocol_version = version;
+    return 0;
+}
+
+/**
+ * Publishes a request and calls the callback with the response or on timeout.
+ */
+int libmqttlink_request(const char *topic, const char *payload, int len, unsigned int timeout_ms,
+                        void (*response_function_ptr)(enum _enum_libmqttlink_request_status status, const char *payload, int len, void *user_data), void *user_data)
+{
+    if (topic == NULL || response_function_ptr == NULL || (payload == NULL && len > 0) || len < 0)
+    {
+        printf("%s(): NULL values are not allowed.\n", __func__);
+        return -1;
+    }
+    if (libmqttlink_get_connection_state() == e_libmqttlink_connection_state_connection_false || g_rpc_reply_topic[0] == '\0')
+    {
+        printf("%s(): Request could not be sent. Not connected with MQTT 5.\n", __func__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_rpc_mutex);
+    if (rpc_reserve() != 0)
+    {
+        pthread_mutex_unlock(&g_rpc_mutex);
+        printf("%s(): Out of memory.\n", __func__);
+        return -1;
+    }
+    uint64_t id = ++g_rpc_next_correlation_id;
+    int32_t index = rpc_insert(id, timeout_ms, response_function_ptr, user_data);
+    pthread_mutex_unlock(&g_rpc_mutex);
+
+    unsigned char correlation_data[8];
+    for (int i = 0; i < 8; ++i)
+        correlation_data[i] = (unsigned char)(id >> (56 - 8 * i));
+    mosquitto_property *properties = NULL;
+    int result = mosquitto_property_add_string(&properties, MQTT_PROP_RESPONSE_TOPIC, g_rpc_reply_topic);
+    if (result == MOSQ_ERR_SUCCESS)
+        result = mosquitto_property_add_binary(&properties, MQTT_PROP_CORRELATION_DATA, correlation_data, sizeof(correlation_data));
+    if (result == MOSQ_ERR_SUCCESS)
+        result = publish_payload(topic, payload ? payload : "", (size_t)len, 1, properties);
+    mosquitto_property_free_all(&properties);
+    if (result != MOSQ_ERR_SUCCESS)
+    {
+        printf("%s(): Request could not be sent. Reason: [%s]\n", __func__, mosquitto_strerror(result));
+        pthread_mutex_lock(&g_rpc_mutex);
+        uint32_t bucket = rpc_table_find(id);
+        if (g_rpc_table[bucket] == index) // not expired meanwhile
+        {
+            rpc_table_remove(bucket);
+            rpc_release(index);
+        }
+        pthread_mutex_unlock(&g_rpc_mutex);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Responds to the request whose subscriber callback is running on this thread.
+ */
+int libmqttlink_respond(const char *payload, int len)
+{
+    if ((payload == NULL && len > 0) || len < 0)
+        return -1;
+    const mosquitto_property *properties = g_current_message_properties;
+    char *response_topic = NULL;
+    if (properties == NULL || mosquitto_property_read_string(properties, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false) == NULL)
+    {
+        printf("%s(): Message being handled has no response topic.\n", __func__);
+        return -1;
+    }
+
+    mosquitto_property *response_properties = NULL;
+    void *correlation_data = NULL;
+    uint16_t correlation_len = 0;
+    int result = MOSQ_ERR_SUCCESS;
+    if (mosquitto_property_read_binary(properties, MQTT_PROP_CORRELATION_DATA, &correlation_data, &correlation_len, false))
+        result = mosquitto_property_add_binary(&response_properties, MQTT_PROP_CORRELATION_DATA, correlation_data, correlation_len);
+    if (result == MOSQ_ERR_SUCCESS)
+        result = publish_payload(response_topic, payload ? payload : "", (size_t)len, 1, response_properties);
+    mosquitto_property_free_all(&response_properties);
+    free(correlation_data);
+    if (result != MOSQ_ERR_SUCCESS)
+        printf("%s(): Response to [%s] could not be sent. Reason: [%s]\n", __func__, response_topic, mosquitto_strerror(result));
+    free(response_topic);
+    return result == MOSQ_ERR_SUCCESS ? 0 : -1;
+}
+
 /**
  * Sets the Last Will message.
  */
@@ -646,6 +2681,56 @@ int libmqttlink_set_tls(const char *cafile, const char *capath, const char *cert
     return 0;
 }
 
+/**
+ * Configures TLS session resumption, cipher lists and key exchange groups.
+ */
+int libmqttlink_set_tls_options(int session_resumption, const char *ciphers, const char *ciphersuites, const char *groups)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+#ifndef MQTTLINK_OPENSSL
+    (void)ptr;
+    (void)session_resumption;
+    (void)ciphers;
+    (void)ciphersuites;
+    (void)groups;
+    printf("%s(): Library was built without OpenSSL support.\n", __func__);
+    return -1;
+#else
+    if (ptr->mosquitto_structer_ptr != NULL)
+        return -1; // set before connect
+    if (ptr->tls_ciphers) free((void*)ptr->tls_ciphers);
+    if (ptr->tls_ciphersuites) free((void*)ptr->tls_ciphersuites);
+    if (ptr->tls_groups) free((void*)ptr->tls_groups);
+    ptr->tls_ciphers = ciphers ? strdup_safe(ciphers) : NULL;
+    ptr->tls_ciphersuites = ciphersuites ? strdup_safe(ciphersuites) : NULL;
+    ptr->tls_groups = groups ? strdup_safe(groups) : NULL;
+    ptr->tls_session_resumption = session_resumption ? 1 : 0;
+
+    // settings are baked into the shared context when it is created
+    pthread_mutex_lock(&g_tls_mutex);
+    if (g_ssl_ctx) { SSL_CTX_free(g_ssl_ctx); g_ssl_ctx = NULL; }
+    pthread_mutex_unlock(&g_tls_mutex);
+    return 0;
+#endif
+}
+
+/**
+ * Returns TLS handshake timing and session resumption counters.
+ */
+int libmqttlink_get_tls_stats(struct _struct_libmqttlink_tls_stats *stats)
+{
+    if (stats == NULL)
+        return -1;
+#ifndef MQTTLINK_OPENSSL
+    return -1;
+#else
+    pthread_mutex_lock(&g_tls_mutex);
+    *stats = g_tls_stats;
+    pthread_mutex_unlock(&g_tls_mutex);
+    return 0;
+#endif
+}
+
 /**
  * Returns the current connection state of the MQTT link.
  */
@@ -657,3 +2742,391 @@ enum _enum_libmqttlink_connection_state libmqttlink_get_connection_state(void)
     pthread_mutex_unlock(&g_state_mutex);
     return st;
 }
+
+/**
+ * Configures how the connection to the broker is established.
+ */
+int libmqttlink_set_connect_options(int async, unsigned int connect_timeout_ms, const char *const *addresses, unsigned int number_of_addresses)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (ptr->mosquitto_structer_ptr != NULL)
+        return -1; // set before connect
+    if (number_of_addresses && addresses == NULL)
+        return -1;
+
+    for (unsigned int i = 0; i < ptr->number_of_connect_addresses; ++i)
+        free(ptr->connect_addresses[i]);
+    free(ptr->connect_addresses);
+    ptr->connect_addresses = NULL;
+    ptr->number_of_connect_addresses = 0;
+
+    if (number_of_addresses)
+    {
+        ptr->connect_addresses = calloc(number_of_addresses, sizeof(char *));
+        if (!ptr->connect_addresses)
+            return -1;
+        for (unsigned int i = 0; i < number_of_addresses; ++i)
+        {
+            ptr->connect_addresses[i] = strdup_safe(addresses[i]);
+            if (!ptr->connect_addresses[i])
+                return -1;
+            ptr->number_of_connect_addresses++;
+        }
+    }
+    ptr->connect_async = async ? 1 : 0;
+    ptr->connect_timeout_ms = connect_timeout_ms;
+    return 0;
+}
+
+/**
+ * Sets a callback invoked each time the connection to the broker is established.
+ */
+int libmqttlink_set_ready_callback(void (*ready_function_ptr)(void))
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (ptr->mosquitto_structer_ptr != NULL)
+        return -1; // set before connect
+    ptr->ready_function_ptr = ready_function_ptr;
+    return 0;
+}
+
+/**
+ * Blocks until the connection to the broker is established or the timeout expires.
+ */
+int libmqttlink_wait_ready(unsigned int timeout_ms)
+{
+    pthread_once(&g_state_cond_once, state_cond_init);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = 0;
+    pthread_mutex_lock(&g_state_mutex);
+    while (g_libmqttlink_struct.connection_state_flag != e_libmqttlink_connection_state_connection_true && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&g_state_cond, &g_state_mutex, &deadline);
+    int connected = (g_libmqttlink_struct.connection_state_flag == e_libmqttlink_connection_state_connection_true);
+    pthread_mutex_unlock(&g_state_mutex);
+    return connected ? 0 : -1;
+}
+
+/**
+ * Sets CPU affinity, scheduling and naming for a library thread role.
+ */
+int libmqttlink_set_thread_config(enum _enum_libmqttlink_thread_role role, const struct _struct_libmqttlink_thread_config *config)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (ptr->mosquitto_structer_ptr != NULL || ptr->link_control_thread_id != 0)
+    {
+        printf("%s(): Thread placement must be set before connecting.\n", __func__);
+        return -1;
+    }
+    if ((int)role < 0 || role >= e_libmqttlink_thread_role_count || config == NULL)
+        return -1;
+    struct struct_thread_config *dst = &g_thread_config[role];
+    if (config->number_of_cpus > sizeof(dst->cpus) / sizeof(dst->cpus[0]) || (config->number_of_cpus && config->cpus == NULL))
+    {
+        printf("%s(): Invalid CPU list.\n", __func__);
+        return -1;
+    }
+    for (unsigned int i = 0; i < config->number_of_cpus; ++i)
+    {
+        if (config->cpus[i] < 0 || config->cpus[i] >= CPU_SETSIZE)
+        {
+            printf("%s(): Invalid CPU [%d].\n", __func__, config->cpus[i]);
+            return -1;
+        }
+    }
+    if (config->sched_fifo_priority < 0 || config->sched_fifo_priority > sched_get_priority_max(SCHED_FIFO))
+    {
+        printf("%s(): Invalid SCHED_FIFO priority [%d].\n", __func__, config->sched_fifo_priority);
+        return -1;
+    }
+
+    if (config->number_of_cpus)
+        memcpy(dst->cpus, config->cpus, config->number_of_cpus * sizeof(int));
+    dst->number_of_cpus = config->number_of_cpus;
+    dst->sched_fifo_priority = config->sched_fifo_priority;
+    dst->stack_size = config->stack_size;
+    if (config->name)
+        snprintf(dst->name, sizeof(dst->name), "%s", config->name);
+    return 0;
+}
+
+/**
+ * Configures payload compression for published and received messages.
+ */
+int libmqttlink_set_compression(enum _enum_libmqttlink_codec codec, int level, unsigned int min_size, const void *dictionary, unsigned int dictionary_size)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (ptr->mosquitto_structer_ptr != NULL)
+        return -1; // set before connect
+#ifndef MQTTLINK_LZ4
+    if (codec == e_libmqttlink_codec_lz4)
+    {
+        printf("%s(): Library was built without lz4 support.\n", __func__);
+        return -1;
+    }
+#endif
+#ifndef MQTTLINK_ZSTD
+    if (codec == e_libmqttlink_codec_zstd)
+    {
+        printf("%s(): Library was built without zstd support.\n", __func__);
+        return -1;
+    }
+#endif
+    if (codec != e_libmqttlink_codec_none && codec != e_libmqttlink_codec_lz4 && codec != e_libmqttlink_codec_zstd)
+        return -1;
+
+    // drop previous dictionary state
+    if (ptr->codec_dictionary) { free(ptr->codec_dictionary); ptr->codec_dictionary = NULL; }
+    ptr->codec_dictionary_size = 0;
+#ifdef MQTTLINK_ZSTD
+    ZSTD_freeCDict(g_zstd_cdict);
+    ZSTD_freeDDict(g_zstd_ddict);
+    g_zstd_cdict = NULL;
+    g_zstd_ddict = NULL;
+#endif
+#ifdef MQTTLINK_LZ4
+    if (g_lz4_dict_stream) { LZ4_freeStream(g_lz4_dict_stream); g_lz4_dict_stream = NULL; }
+#endif
+
+    ptr->codec = codec;
+    ptr->codec_level = level;
+    ptr->codec_min_size = min_size;
+    if (codec == e_libmqttlink_codec_none || dictionary == NULL || dictionary_size == 0)
+        return 0;
+
+    ptr->codec_dictionary = malloc(dictionary_size);
+    if (!ptr->codec_dictionary)
+    {
+        ptr->codec = e_libmqttlink_codec_none;
+        return -1;
+    }
+    memcpy(ptr->codec_dictionary, dictionary, dictionary_size);
+    ptr->codec_dictionary_size = dictionary_size;
+
+    int rc = 0;
+#ifdef MQTTLINK_ZSTD
+    if (codec == e_libmqttlink_codec_zstd)
+    {
+        g_zstd_cdict = ZSTD_createCDict(ptr->codec_dictionary, dictionary_size, level);
+        g_zstd_ddict = ZSTD_createDDict(ptr->codec_dictionary, dictionary_size);
+        if (!g_zstd_cdict || !g_zstd_ddict)
+            rc = -1;
+    }
+#endif
+#ifdef MQTTLINK_LZ4
+    if (codec == e_libmqttlink_codec_lz4)
+    {
+        g_lz4_dict_stream = LZ4_createStream();
+        if (g_lz4_dict_stream)
+            LZ4_loadDict(g_lz4_dict_stream, ptr->codec_dictionary, (int)dictionary_size);
+        else
+            rc = -1;
+    }
+#endif
+    if (rc != 0)
+    {
+        printf("%s(): Could not load compression dictionary.\n", __func__);
+        ptr->codec = e_libmqttlink_codec_none;
+    }
+    return rc;
+}
+
+/**
+ * Enables publish coalescing for topics matching a pattern.
+ */
+int libmqttlink_set_publish_coalescing(const char *topic_pattern, unsigned int flush_interval_ms, double change_delta, double max_rate_per_sec, unsigned int burst)
+{
+    if (topic_pattern == NULL)
+    {
+        printf("%s(): NULL values are not allowed.\n", __func__);
+        return -1;
+    }
+    size_t tlen = strlen(topic_pattern);
+    if (tlen >= sizeof(((struct struct_coalesce_rule *)0)->topic_pattern))
+    {
+        printf("%s(): Topic pattern too long.\n", __func__);
+        return -1;
+    }
+    if (max_rate_per_sec < 0)
+        max_rate_per_sec = 0;
+    if (burst == 0)
+        burst = 1;
+
+    pthread_mutex_lock(&g_coalesce_mutex);
+    struct struct_coalesce_rule *rule = NULL;
+    for (uint16_t i = 0; i < g_number_of_coalesce_rules; ++i)
+    {
+        if (!strcmp(g_coalesce_rules[i].topic_pattern, topic_pattern))
+        {
+            rule = &g_coalesce_rules[i];
+            break;
+        }
+    }
+    if (rule == NULL)
+    {
+        uint16_t new_count = g_number_of_coalesce_rules + 1;
+        struct struct_coalesce_rule *tmp = realloc(g_coalesce_rules, new_count * sizeof(*tmp));
+        if (!tmp)
+        {
+            printf("%s(): realloc() failed.\n", __func__);
+            pthread_mutex_unlock(&g_coalesce_mutex);
+            return -1;
+        }
+        g_coalesce_rules = tmp;
+        g_number_of_coalesce_rules = new_count;
+        rule = &g_coalesce_rules[new_count - 1];
+        memset(rule, 0, sizeof(*rule));
+        memcpy(rule->topic_pattern, topic_pattern, tlen + 1);
+        coalesce_forget_unmatched(); // cached misses may match the new rule
+        atomic_store(&g_coalesce_enabled, true);
+    }
+    rule->flush_interval_ms = flush_interval_ms;
+    rule->change_delta = change_delta;
+    rule->max_rate_per_sec = max_rate_per_sec;
+    rule->burst = burst;
+    pthread_mutex_unlock(&g_coalesce_mutex);
+    return 0;
+}
+
+/**
+ * Returns the publish coalescing counters for a topic pattern.
+ */
+int libmqttlink_get_coalescing_stats(const char *topic_pattern, struct _struct_libmqttlink_coalescing_stats *stats)
+{
+    if (topic_pattern == NULL || stats == NULL)
+        return -1;
+    int rc = -1;
+    pthread_mutex_lock(&g_coalesce_mutex);
+    for (uint16_t i = 0; i < g_number_of_coalesce_rules; ++i)
+    {
+        if (!strcmp(g_coalesce_rules[i].topic_pattern, topic_pattern))
+        {
+            *stats = g_coalesce_rules[i].stats;
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_coalesce_mutex);
+    return rc;
+}
+
+/**
+ * Enables sampled latency tracing.
+ */
+int libmqttlink_set_tracing(unsigned int sample_every, unsigned int ring_size)
+{
+    struct struct_libmqttlink_struct *ptr = &g_libmqttlink_struct;
+    if (ptr->mosquitto_structer_ptr != NULL)
+        return -1; // set before connect
+
+    g_trace_sample_every = 0;
+    free(g_trace_ring);
+    g_trace_ring = NULL;
+    g_trace_ring_size = 0;
+    atomic_store(&g_trace_head, 0);
+    if (sample_every == 0)
+        return 0;
+
+    uint32_t size = 64;
+    while (size < ring_size && size < (1u << 24))
+        size <<= 1;
+    g_trace_ring = calloc(size, sizeof(*g_trace_ring));
+    if (!g_trace_ring)
+    {
+        printf("%s(): calloc() failed.\n", __func__);
+        return -1;
+    }
+    g_trace_ring_size = size;
+    g_trace_sample_every = sample_every;
+    return 0;
+}
+
+/**
+ * Copies the most recent trace spans out of the ring.
+ */
+int libmqttlink_trace_read(struct _struct_libmqttlink_trace_span *spans, int max_spans)
+{
+    if (spans == NULL || max_spans <= 0 || g_trace_ring == NULL)
+        return 0;
+    uint64_t head = atomic_load_explicit(&g_trace_head, memory_order_acquire);
+    uint64_t available = head < g_trace_ring_size ? head : g_trace_ring_size;
+    uint64_t start = head - (available < (uint64_t)max_spans ? available : (uint64_t)max_spans);
+    int count = 0;
+    for (uint64_t index = start; index < head; ++index)
+    {
+        struct struct_trace_slot *slot = &g_trace_ring[index & (g_trace_ring_size - 1)];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence != 2 * index + 2)
+            continue; // still being written or already overwritten
+        spans[count] = slot->span;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) == sequence)
+            count++;
+    }
+    return count;
+}
+
+/**
+ * Writes the traced spans as CSV.
+ */
+int libmqttlink_trace_dump(FILE *stream)
+{
+    if (stream == NULL || g_trace_ring_size == 0)
+        return -1;
+    struct _struct_libmqttlink_trace_span *spans = malloc(g_trace_ring_size * sizeof(*spans));
+    if (!spans)
+        return -1;
+    int count = libmqttlink_trace_read(spans, (int)g_trace_ring_size);
+    fprintf(stream, "kind,topic,start_ns,callback_entry_ns,end_ns,duration_us,callback_us,transit_us\n");
+    for (int i = 0; i < count; ++i)
+    {
+        const struct _struct_libmqttlink_trace_span *span = &spans[i];
+        double callback_us = span->callback_entry_ns ? (span->end_ns - span->callback_entry_ns) / 1000.0 : 0;
+        fprintf(stream, "%s,\"", span->kind == e_libmqttlink_trace_kind_publish ? "publish" : "receive");
+        // topics may contain commas and quotes, quote the field and double embedded quotes
+        for (const char *c = span->topic; *c; ++c)
+        {
+            if (*c == '"')
+                fputc('"', stream);
+            fputc(*c, stream);
+        }
+        fprintf(stream, "\",%lld,%lld,%lld,%.3f,%.3f,", span->start_ns, span->callback_entry_ns, span->end_ns, (span->end_ns - span->start_ns) / 1000.0,
+                callback_us);
+        // empty for unstamped messages, a negative value is clock skew between the hosts
+        if (span->transit_ns != -1)
+            fprintf(stream, "%.3f", span->transit_ns / 1000.0);
+        fputc('\n', stream);
+    }
+    free(spans);
+    return count;
+}
+
+/**
+ * Returns the broker transit latency histogram of a topic.
+ */
+int libmqttlink_get_transit_histogram(const char *topic, struct _struct_libmqttlink_latency_histogram *histogram)
+{
+    if (topic == NULL || histogram == NULL)
+        return -1;
+    int rc = -1;
+    pthread_mutex_lock(&g_trace_mutex);
+    for (uint16_t i = 0; i < g_number_of_trace_topics; ++i)
+    {
+        if (!strcmp(g_trace_topics[i].topic, topic))
+        {
+            *histogram = g_trace_topics[i].histogram;
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_trace_mutex);
+    return rc;
+}
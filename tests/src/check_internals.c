@@ -0,0 +1,424 @@
+// Broker-free checks of the library internals: request correlation table, timeout wheel, coalescing
+// token bucket, batch limits, payload codec framing and the trace ring.
+// Includes the library source to reach its internal functions, no broker or installed library is needed.
+// The timeout wheel runs on a stepped clock, so no check depends on wall clock timing.
+#include "../../src/libmqttlink.c"
+
+#define CHECK(condition)                                                        \
+    do                                                                          \
+    {                                                                           \
+        g_checks++;                                                             \
+        if (!(condition))                                                       \
+        {                                                                       \
+            g_failures++;                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __func__, __LINE__, #condition); \
+        }                                                                       \
+    } while (0)
+
+static int g_checks = 0;
+static int g_failures = 0;
+
+static void check_correlation_table(void);
+static void check_timer_wheel(void);
+static void check_token_bucket(void);
+static void check_batch_limits(void);
+static void check_codec_framing(void);
+static void check_trace_ring(void);
+
+int main(void)
+{
+    check_correlation_table();
+    check_timer_wheel();
+    check_token_bucket();
+    check_batch_limits();
+    check_codec_framing();
+    check_trace_ring();
+
+    printf("%d checks, %d failed\n", g_checks, g_failures);
+    return g_failures ? 1 : 0;
+}
+
+static int g_timeouts = 0;
+
+static void on_response(enum _enum_libmqttlink_request_status status, const char *payload, int len, void *user_data)
+{
+    (void)payload;
+    (void)len;
+    if (status == e_libmqttlink_request_status_timeout)
+        g_timeouts++;
+    *(int *)user_data = (int)status + 1;
+}
+
+static void rpc_reset(void)
+{
+    pthread_mutex_lock(&g_rpc_mutex);
+    free(g_rpc_pool);
+    free(g_rpc_table);
+    g_rpc_pool = NULL;
+    g_rpc_pool_capacity = 0;
+    g_rpc_free_head = -1;
+    g_rpc_table = NULL;
+    g_rpc_table_capacity = 0;
+    g_rpc_outstanding = 0;
+    for (int i = 0; i < RPC_WHEEL_SLOTS; ++i)
+        g_rpc_wheel[i] = -1;
+    g_rpc_current_tick = rpc_tick_now();
+    pthread_mutex_unlock(&g_rpc_mutex);
+}
+
+// Returns true if id is found in the hash map, i.e. its probe sequence from the home bucket has no hole.
+static bool rpc_lookup(uint64_t id)
+{
+    uint32_t bucket = rpc_table_find(id);
+    return g_rpc_table[bucket] != -1 && g_rpc_pool[g_rpc_table[bucket]].correlation_id == id;
+}
+
+static void check_correlation_table(void)
+{
+    enum
+    {
+        number_of_ids = 3000
+    };
+    static int states[number_of_ids];
+    rpc_reset();
+
+    // ids spaced by the table size collide on the same home bucket and form long clusters
+    pthread_mutex_lock(&g_rpc_mutex);
+    for (uint64_t i = 0; i < number_of_ids; ++i)
+    {
+        CHECK(rpc_reserve() == 0);
+        rpc_insert(i % 7 == 0 ? i * 4096 : i, 60000, on_response, &states[i]);
+    }
+    CHECK(g_rpc_outstanding == number_of_ids);
+    CHECK(g_rpc_outstanding * 2 <= g_rpc_table_capacity);
+
+    bool all_found = true;
+    for (uint64_t i = 0; i < number_of_ids; ++i)
+        all_found &= rpc_lookup(i % 7 == 0 ? i * 4096 : i);
+    CHECK(all_found);
+
+    // remove every third id, the rest must stay reachable after each backward shift
+    bool removed_gone = true;
+    all_found = true;
+    for (uint64_t i = 0; i < number_of_ids; i += 3)
+    {
+        uint64_t id = i % 7 == 0 ? i * 4096 : i;
+        uint32_t bucket = rpc_table_find(id);
+        int32_t index = g_rpc_table[bucket];
+        rpc_table_remove(bucket);
+        rpc_release(index);
+        removed_gone &= !rpc_lookup(id);
+    }
+    for (uint64_t i = 0; i < number_of_ids; ++i)
+    {
+        bool found = rpc_lookup(i % 7 == 0 ? i * 4096 : i);
+        if (i % 3 == 0)
+            removed_gone &= !found;
+        else
+            all_found &= found;
+    }
+    CHECK(removed_gone);
+    CHECK(all_found);
+    CHECK(g_rpc_outstanding == number_of_ids - (number_of_ids + 2) / 3);
+
+    // no bucket may be left pointing at a released request
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < g_rpc_table_capacity; ++i)
+        used += g_rpc_table[i] != -1;
+    CHECK(used == g_rpc_outstanding);
+    pthread_mutex_unlock(&g_rpc_mutex);
+
+    rpc_cancel_all();
+    CHECK(g_rpc_outstanding == 0);
+}
+
+// Stepped clock for the timeout wheel. Kept 5 ms into a tick so that rounding never moves a tick boundary.
+static uint64_t g_clock_ms = 1000005;
+
+static double stepped_clock(void)
+{
+    return g_clock_ms / 1000.0;
+}
+
+static void check_timer_wheel(void)
+{
+    int early = 0, wrapped = 0, far = 0;
+    g_rpc_clock = stepped_clock;
+    rpc_reset();
+
+    // 5250 ms is more than one wheel turn (5120 ms): it shares its slot with the 130 ms request
+    pthread_mutex_lock(&g_rpc_mutex);
+    CHECK(rpc_reserve() == 0);
+    int32_t early_index = rpc_insert(1, 130, on_response, &early);
+    CHECK(rpc_reserve() == 0);
+    int32_t wrapped_index = rpc_insert(2, 5250, on_response, &wrapped);
+    CHECK(rpc_reserve() == 0);
+    rpc_insert(3, 8000, on_response, &far);
+    CHECK(g_rpc_pool[early_index].wheel_slot == g_rpc_pool[wrapped_index].wheel_slot);
+    pthread_mutex_unlock(&g_rpc_mutex);
+
+    int next_ms = rpc_next_timeout_ms();
+    CHECK(next_ms >= 124 && next_ms <= 126);
+
+    g_clock_ms += 120;
+    rpc_expire_due();
+    CHECK(early == 0);
+    g_clock_ms += 10;
+    rpc_expire_due();
+    CHECK(early == e_libmqttlink_request_status_timeout + 1);
+    CHECK(wrapped == 0 && far == 0);
+    CHECK(g_rpc_outstanding == 2);
+
+    // the next non-empty slot is the one of the 8000 ms request, one turn before it is due
+    next_ms = rpc_next_timeout_ms();
+    CHECK(next_ms >= 2744 && next_ms <= 2746);
+
+    // visiting that slot early must not expire it
+    g_clock_ms += 2750;
+    rpc_expire_due();
+    CHECK(far == 0);
+
+    // the shared slot comes round again one turn after the 130 ms request expired
+    while (g_clock_ms < 1000005 + 5240)
+    {
+        g_clock_ms += 10;
+        rpc_expire_due();
+    }
+    CHECK(wrapped == 0);
+    g_clock_ms += 10;
+    rpc_expire_due();
+    CHECK(wrapped == e_libmqttlink_request_status_timeout + 1);
+    CHECK(far == 0);
+
+    // a stall longer than one turn visits every slot once and catches up
+    g_clock_ms += 20000;
+    rpc_expire_due();
+    CHECK(far == e_libmqttlink_request_status_timeout + 1);
+    CHECK(g_timeouts == 3);
+    CHECK(g_rpc_outstanding == 0);
+    CHECK(rpc_next_timeout_ms() == -1);
+
+    g_rpc_clock = get_monotonic_time;
+    rpc_cancel_all();
+}
+
+static void check_token_bucket(void)
+{
+    struct struct_coalesce_rule rule = {.max_rate_per_sec = 10, .burst = 3};
+    struct struct_coalesce_slot slot = {.tokens = rule.burst, .last_refill_time = 100.0};
+
+    int taken = 0;
+    for (int i = 0; i < 5; ++i)
+        taken += coalesce_take_token(&slot, &rule, 100.0);
+    CHECK(taken == 3);
+
+    // 10 tokens per second: one after 100 ms, none more at the same instant
+    CHECK(!coalesce_take_token(&slot, &rule, 100.05));
+    CHECK(coalesce_take_token(&slot, &rule, 100.15));
+    CHECK(!coalesce_take_token(&slot, &rule, 100.15));
+
+    // a long pause refills at most the burst
+    taken = 0;
+    for (int i = 0; i < 10; ++i)
+        taken += coalesce_take_token(&slot, &rule, 200.0);
+    CHECK(taken == 3);
+
+    struct struct_coalesce_rule unlimited = {0};
+    CHECK(coalesce_take_token(&slot, &unlimited, 200.0));
+}
+
+static unsigned int g_delivered_count = 0;
+static bool g_delivered_ok = false;
+
+static void on_batch(const struct _struct_libmqttlink_batch_message *messages, unsigned int count, const char *topic)
+{
+    g_delivered_count = count;
+    g_delivered_ok = !strcmp(topic, "sensor/#");
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "value-%u", i);
+        g_delivered_ok &= !strcmp(messages[i].topic, "sensor/a") && !strcmp(messages[i].payload, expected) && messages[i].len == strlen(expected);
+    }
+}
+
+static void check_batch_limits(void)
+{
+    struct struct_batch_state *batch = calloc(1, sizeof(*batch));
+    batch->batch_function_ptr = on_batch;
+    snprintf(batch->topic, sizeof(batch->topic), "sensor/#");
+    batch->max_messages = 100;
+
+    // count limit, crossing the initial entry and data capacities on the way
+    bool full = false;
+    char payload[32];
+    for (unsigned int i = 0; i < 100; ++i)
+    {
+        int len = snprintf(payload, sizeof(payload), "value-%u", i);
+        CHECK(!full);
+        full = batch_append(batch, "sensor/a", payload, (size_t)len);
+    }
+    CHECK(full);
+    CHECK(batch->count == 100);
+    batch_deliver(batch);
+    CHECK(g_delivered_count == 100);
+    CHECK(g_delivered_ok);
+    CHECK(batch->count == 0 && batch->data_size == 0);
+
+    // byte limit counts topic, payload and both terminators
+    batch->max_messages = 0;
+    batch->max_bytes = 3 * (sizeof("sensor/a") + sizeof("value-0"));
+    CHECK(!batch_append(batch, "sensor/a", "value-0", 7));
+    CHECK(!batch_append(batch, "sensor/a", "value-1", 7));
+    CHECK(batch_append(batch, "sensor/a", "value-2", 7));
+    batch_deliver(batch);
+    CHECK(g_delivered_count == 3);
+    CHECK(g_delivered_ok);
+
+    batch_state_free(batch);
+}
+
+static void check_codec_framing(void)
+{
+    struct struct_codec_thread_state *state = get_codec_thread_state();
+    CHECK(state != NULL);
+    if (!state)
+        return;
+
+    char payload[2048];
+    size_t len = 0;
+    for (int i = 0; len + 64 < sizeof(payload); ++i)
+        len += (size_t)snprintf(payload + len, sizeof(payload) - len, "{\"device\":%d,\"temperature\":21.5},", i % 4);
+
+    const char *out = NULL;
+    size_t out_len = 0;
+    const char *decoded = NULL;
+
+    // without a codec payloads are sent as is and binary payloads resembling the header pass through
+    libmqttlink_set_compression(e_libmqttlink_codec_none, 0, 0, NULL, 0);
+    codec_encode(state, payload, len, &out, &out_len);
+    CHECK(out == payload && out_len == len);
+    const char foreign[] = {0x00, 'm', e_libmqttlink_codec_lz4, 0, 0, 0, 4, 'a', 'b'};
+    CHECK(codec_decode(state, foreign, sizeof(foreign), NULL, &decoded) == (long)sizeof(foreign));
+    CHECK(!memcmp(decoded, foreign, sizeof(foreign)));
+
+#if defined(MQTTLINK_LZ4) || defined(MQTTLINK_ZSTD)
+    enum _enum_libmqttlink_codec codecs[] = {
+#ifdef MQTTLINK_LZ4
+        e_libmqttlink_codec_lz4,
+#endif
+#ifdef MQTTLINK_ZSTD
+        e_libmqttlink_codec_zstd,
+#endif
+    };
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c)
+    {
+        for (int use_dictionary = 0; use_dictionary < 2; ++use_dictionary)
+        {
+            CHECK(libmqttlink_set_compression(codecs[c], 1, 64, use_dictionary ? payload : NULL, use_dictionary ? 512 : 0) == 0);
+
+            // in-band header: magic, codec id, big endian original length
+            codec_encode(state, payload, len, &out, &out_len);
+            const unsigned char *header = (const unsigned char *)out;
+            CHECK(out != payload && out_len < len);
+            CHECK(header[0] == CODEC_MAGIC_0 && header[1] == CODEC_MAGIC_1 && header[2] == codecs[c]);
+            CHECK((((size_t)header[3] << 24) | ((size_t)header[4] << 16) | ((size_t)header[5] << 8) | header[6]) == len);
+
+            // codec_decode() reuses the thread buffer codec_encode() does not touch
+            char *framed = malloc(out_len);
+            memcpy(framed, out, out_len);
+            size_t framed_len = out_len;
+            CHECK(codec_decode(state, framed, framed_len, NULL, &decoded) == (long)len);
+            CHECK(!memcmp(decoded, payload, len) && decoded[len] == '\0');
+
+            // MQTT 5 marker: the body without the header, codec and length in a user property
+            mosquitto_property *properties = NULL;
+            char marker[32];
+            snprintf(marker, sizeof(marker), "%s:%zu", codec_name(codecs[c]), len);
+            CHECK(mosquitto_property_add_string_pair(&properties, MQTT_PROP_USER_PROPERTY, CODEC_PROPERTY_NAME, marker) == MOSQ_ERR_SUCCESS);
+            CHECK(codec_decode(state, framed + CODEC_HEADER_SIZE, framed_len - CODEC_HEADER_SIZE, properties, &decoded) == (long)len);
+            CHECK(!memcmp(decoded, payload, len));
+            mosquitto_property_free_all(&properties);
+
+            // a corrupted length is rejected instead of delivering a short payload
+            framed[6] ^= 1;
+            CHECK(codec_decode(state, framed, framed_len, NULL, &decoded) == -1);
+            free(framed);
+
+            // small payloads stay below min_size and are not framed
+            codec_encode(state, payload, 32, &out, &out_len);
+            CHECK(out == payload && out_len == 32);
+        }
+    }
+    libmqttlink_set_compression(e_libmqttlink_codec_none, 0, 0, NULL, 0);
+#endif
+}
+
+#define TRACE_WRITERS 4
+#define TRACE_SPANS_PER_WRITER 200000
+
+static atomic_bool g_trace_writers_done = false;
+
+static void *trace_writer(void *arg)
+{
+    long writer = (long)arg;
+    struct _struct_libmqttlink_trace_span span = {0};
+    for (long long i = 0; i < TRACE_SPANS_PER_WRITER; ++i)
+    {
+        // every field derived from the same value: a torn read shows up as a mismatch
+        span.kind = (enum _enum_libmqttlink_trace_kind)(writer & 1);
+        snprintf(span.topic, sizeof(span.topic), "w%ld/%lld", writer, i);
+        span.start_ns = writer * 1000000000LL + i;
+        span.callback_entry_ns = span.start_ns + 1;
+        span.end_ns = span.start_ns + 2;
+        span.transit_ns = span.start_ns + 3;
+        trace_push(&span);
+    }
+    return NULL;
+}
+
+static bool trace_span_consistent(const struct _struct_libmqttlink_trace_span *span)
+{
+    char topic[64];
+    snprintf(topic, sizeof(topic), "w%lld/%lld", span->start_ns / 1000000000LL, span->start_ns % 1000000000LL);
+    return span->callback_entry_ns == span->start_ns + 1 && span->end_ns == span->start_ns + 2 && span->transit_ns == span->start_ns + 3 &&
+           (long long)span->kind == ((span->start_ns / 1000000000LL) & 1) && !strcmp(span->topic, topic);
+}
+
+static void check_trace_ring(void)
+{
+    CHECK(libmqttlink_set_tracing(1, 100) == 0);
+    CHECK(g_trace_ring_size == 128);
+
+    pthread_t writers[TRACE_WRITERS];
+    for (long i = 0; i < TRACE_WRITERS; ++i)
+        pthread_create(&writers[i], NULL, trace_writer, (void *)i);
+
+    // readers may skip slots being overwritten but must never return a torn span
+    static struct _struct_libmqttlink_trace_span spans[128];
+    long long reads = 0, torn = 0;
+    while (!atomic_load(&g_trace_writers_done))
+    {
+        int count = libmqttlink_trace_read(spans, 128);
+        for (int i = 0; i < count; ++i)
+            torn += !trace_span_consistent(&spans[i]);
+        reads += count;
+        if (atomic_load_explicit(&g_trace_head, memory_order_relaxed) == (uint64_t)TRACE_WRITERS * TRACE_SPANS_PER_WRITER)
+            atomic_store(&g_trace_writers_done, true);
+    }
+    for (int i = 0; i < TRACE_WRITERS; ++i)
+        pthread_join(writers[i], NULL);
+    CHECK(reads > 0);
+    CHECK(torn == 0);
+
+    // once writers are idle the whole ring is readable, newest last
+    CHECK(libmqttlink_trace_read(spans, 128) == 128);
+    bool consistent = true;
+    for (int i = 0; i < 128; ++i)
+        consistent &= trace_span_consistent(&spans[i]);
+    CHECK(consistent);
+    CHECK(libmqttlink_trace_read(spans, 5) == 5);
+
+    libmqttlink_set_tracing(0, 0);
+    CHECK(libmqttlink_trace_read(spans, 128) == 0);
+}